@@ -53,6 +53,30 @@ menuentry "fbtest" {
     boot
 }
 
+menuentry "fbtest+top" {
+    multiboot /$kernel
+    module /kern/irq.mod irq
+    module /kern/pic.mod pic
+    module /kern/console.mod console
+    module /cuser/apic.mod APIC
+    module /cuser/ioapic.mod IOAPIC
+    module /cuser/acpica.mod ACPICA
+    module /cuser/bochsvga.mod bochs
+    module /cuser/fbtest.mod fbtest
+    module /cuser/top.mod top
+    boot
+}
+
+menuentry "ipc_bench" {
+    multiboot /$kernel
+    module /kern/irq.mod irq
+    module /kern/pic.mod pic
+    module /kern/console.mod console
+    module /cuser/ipc_echo.mod ipc_echo
+    module /cuser/ipc_bench.mod ipc_bench
+    boot
+}
+
 menuentry "timer_test" {
     multiboot /$kernel
     module /kern/irq.mod irq
@@ -222,7 +222,9 @@ void start() {
 	// ph_mergepairs has to be made norecursive, or the problem is that a bug
 	// leads it into an infinite loop?
 	__more_stack(0xff000);
+	set_priority(PRIO_DRIVER);
 	logf("starting...\n");
+	lapic_claim(LAPIC_TIMER);
 
 	// Perhaps we should use ACPI information to tell us if/that there's an
 	// APIC and where we can find it.
@@ -259,6 +261,10 @@ void start() {
 	setTIC(-1);
 
 	bool need_eoi = true;
+	// Reply to send with the next receive, 0 for none.
+	ipc_dest_t reply_to = 0;
+	ipc_msg_t reply = 0;
+	ipc_arg_t reply1 = 0, reply2 = 0;
 	for (;;) {
 		{
 			u64 tick_counter = get_tick_counter();
@@ -288,9 +294,10 @@ void start() {
 		}
 
 		ipc_dest_t rcpt = fresh_handle;
-		ipc_arg_t arg1, arg2;
+		ipc_arg_t arg1 = reply1, arg2 = reply2;
 		logf("receiving\n");
-		const ipc_msg_t msg = recv2(&rcpt, &arg1, &arg2);
+		const ipc_msg_t msg = replywait2(reply, reply_to, &rcpt, &arg1, &arg2);
+		reply_to = 0;
 
 		logf("received %x from %p: %lx %lx\n", msg&0xff, rcpt, arg1, arg2);
 
@@ -311,11 +318,15 @@ void start() {
 			hmod_rename(rcpt, (uintptr_t)reg_timer(arg1, arg2));
 			break;
 		case MSG_TIMER_GETTIME:
-			if (msg_get_kind(msg) == MSG_KIND_CALL) {
-				u64 ticks = get_tick_counter();
-				send2(msg & 0xff, rcpt, static_data.ms_counter, ticks);
-			} else {
+			if (msg_get_kind(msg) != MSG_KIND_CALL) {
 				logf("gettime must be a sendrcv call\n");
+			} else if (rcpt == fresh_handle) {
+				send2(msg & 0xff, rcpt, static_data.ms_counter, get_tick_counter());
+			} else {
+				reply_to = rcpt;
+				reply = msg & 0xff;
+				reply1 = static_data.ms_counter;
+				reply2 = get_tick_counter();
 			}
 			if (rcpt == fresh_handle) {
 				hmod_delete(rcpt);
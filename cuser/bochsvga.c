@@ -60,6 +60,7 @@ static const uintptr_t fresh = 0x100;
 #define LFB_SIZE (16 * 1048576)
 
 static u8 mmiospace[LFB_SIZE] PLACEHOLDER_SECTION;
+static u64 msgbuf[512] ALIGN(4096);
 
 static void outb(u16 port, u8 data) {
 	portio(port, 0x11, data);
@@ -75,6 +76,18 @@ static void write_reg(enum Index i, u16 data) {
 	portio(VBE_DISPI_IOPORT_DATA, 0x12, data);
 }
 
+static void set_palette(u32 entry) {
+	u8 c = entry >> 24;
+	u8 r = entry >> 16;
+	u8 g = entry >> 8;
+	u8 b = entry;
+	outb(0x3c8, c);
+	outb(0x3c9, r);
+	outb(0x3c9, g);
+	outb(0x3c9, b);
+	debug("bochsvga: palette %x := (%x,%x,%x)\n", c, r, g, b);
+}
+
 static u32 readpci32(u32 addr, u8 reg)
 {
 	ipc_arg_t arg = addr << 8 | (reg & 0xfc);
@@ -84,6 +97,9 @@ static u32 readpci32(u32 addr, u8 reg)
 
 void start() {
 	__default_section_init();
+	if (!msgbuf_register(msgbuf)) {
+		log("bochsvga: no message buffer, palettes are set one entry at a time\n");
+	}
 
 	ipc_arg_t arg = 0x12341111; // Silly PCI ID of Bochs VGA 1234:1111
 	log("bochsvga: looking for PCI device...\n");
@@ -127,11 +143,16 @@ void start() {
 	debug("bochsvga: Found bochs version %x\n", bochs_id);
 	assert(bochs_id >= VBE_DISPI_ID0 && bochs_id <= VBE_DISPI_ID5);
 
+	// Reply to send with the next receive, 0 for none.
+	ipc_dest_t reply_to = 0;
 	for(;;) {
 		ipc_dest_t rcpt = fresh;
-		arg = 0;
-		arg2 = 0;
-		ipc_msg_t msg = recv2(&rcpt, &arg, &arg2);
+		if (!reply_to) {
+			arg = 0;
+			arg2 = 0;
+		}
+		ipc_msg_t msg = replywait2(MSG_SET_VIDMODE, reply_to, &rcpt, &arg, &arg2);
+		reply_to = 0;
 		debug("bochsvga: received %x from %x: %x %x\n", msg, rcpt, arg, arg2);
 
 		switch (msg & 0xff) {
@@ -150,23 +171,17 @@ void start() {
 			write_reg(INDEX_ENABLE, VBE_DISPI_ENABLED | VBE_DISPI_LFB_ENABLED
 				| VBE_DISPI_8BIT_DAC);
 			debug("bochsvga: mode updated!\n");
-			send2(MSG_SET_VIDMODE, rcpt, arg, arg2);
+			// Echo the mode back to the client.
 			hmod_rename(rcpt, the_client);
+			reply_to = the_client;
 			break;
 		}
 		case MSG_SET_PALETTE:
-		{
-			u8 c = arg >> 24;
-			u8 r = arg >> 16;
-			u8 g = arg >> 8;
-			u8 b = arg;
-			outb(0x3c8, c);
-			outb(0x3c9, r);
-			outb(0x3c9, g);
-			outb(0x3c9, b);
-			debug("bochsvga: palette %x := (%x,%x,%x)\n", c, r, g, b);
+			set_palette(arg);
+			for (unsigned i = 0; i < msg_words(msg); i++) {
+				set_palette(msgbuf[i]);
+			}
 			break;
-		}
 		case MSG_PFAULT:
 		{
 			assert(arg < LFB_SIZE && rcpt == the_client);
@@ -622,6 +622,7 @@ static const u16 pci_dev_ids[] = {
 
 void start() {
 	__default_section_init();
+	set_priority(PRIO_DRIVER);
 
 	ipc_arg_t arg;
 	log("e1000: looking for PCI device...\n");
@@ -696,20 +697,26 @@ void start() {
 		map_dma(PROT_READ | PROT_WRITE,
 				(void*)&descriptors, sizeof(descriptors));
 
+	// Try to get all buffers in one contiguous allocation. Older kernels only
+	// allocate DMA memory page by page, so fall back to that if it fails.
+	u64 receivePhysAddr = map_dma(PROT_READ | PROT_WRITE | PROT_NO_CACHE,
+			receive_buffers, sizeof(receive_buffers));
 	for (size_t i = 0; i < N_DESC; i++) {
-		// Note: DMA memory must still be allocated page by page
-		uintptr_t physAddr = (uintptr_t)map(0,
-				MAP_DMA | PROT_READ | PROT_WRITE | PROT_NO_CACHE,
-				(void*)receive_buffers[i], 0, sizeof(receive_buffers[i]));
+		uintptr_t physAddr = receivePhysAddr
+			? receivePhysAddr + i * BUFFER_SIZE
+			: map_dma(PROT_READ | PROT_WRITE | PROT_NO_CACHE,
+				receive_buffers[i], sizeof(receive_buffers[i]));
 		init_descriptor((union desc*)receive_descriptors + i, physAddr);
 		// Associated to buffers on-demand.
 		init_descriptor((union desc*)transmit_descriptors + i, 0);
 	}
 
+	// TODO Should the buffers be uncachable too?
+	u64 buffersPhysAddr = map_dma(PROT_READ | PROT_WRITE, buffers, sizeof(buffers));
 	for (size_t i = 0; i < NBUFS; i++) {
-		// Note: DMA memory must still be allocated page by page
-		// TODO Should the buffers be uncachable too?
-		u64 physAddr = map_dma(PROT_READ | PROT_WRITE, buffers[i], sizeof(buffers[i]));
+		u64 physAddr = buffersPhysAddr
+			? buffersPhysAddr + i * BUFFER_SIZE
+			: map_dma(PROT_READ | PROT_WRITE, buffers[i], sizeof(buffers[i]));
 		// Just to fault the pages in so we can forward them later.
 		memset(buffers[i], 0, sizeof(buffers[i]));
 		buffer_addr[i] = physAddr;
@@ -767,12 +774,16 @@ void start() {
 	// * TXDW. Fires when transmit descriptors have been written back.
 	mmiospace[IMS] = IM_RXT0 | IM_TXDW | IM_LSC;
 
+	// Reply to send with the next receive, 0 for none.
+	uintptr_t reply_to = 0;
+	ipc_arg_t reply_arg = 0;
 	for(;;) {
 		print_dev_state();
 		uintptr_t rcpt = fresh;
-		arg = 0;
+		arg = reply_arg;
 		arg2 = 0;
-		ipc_msg_t msg = recv2(&rcpt, &arg, &arg2);
+		ipc_msg_t msg = replywait2(MSG_ETHERNET_REG_PROTO, reply_to, &rcpt, &arg, &arg2);
+		reply_to = 0;
 		debug("e1000: received %x from %x: %x %x\n", msg, rcpt, arg, arg2);
 		if (rcpt == pin0_irq_handle && msg == MSG_PULSE) {
 			// Disable all interrupts, then ACK receipt to PIC
@@ -786,7 +797,8 @@ void start() {
 				protocol* proto = reg_proto(arg & 0xffff);
 				log("e1000: registered ethertype %04x => %p\n", arg & 0xffff, proto);
 				hmod(rcpt, (uintptr_t)proto, 0);
-				send1(MSG_ETHERNET_REG_PROTO, (uintptr_t)proto, hwaddr0);
+				reply_to = (uintptr_t)proto;
+				reply_arg = hwaddr0;
 			} else {
 				hmod_delete(rcpt);
 			}
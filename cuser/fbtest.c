@@ -1,3 +1,5 @@
+#include <stdbool.h>
+
 #include "common.h"
 
 #include "msg_fb.h"
@@ -36,12 +38,25 @@ static u16 alpha(u32 dx, u32 dy) {
 	return res;
 }
 
+static u64 msgbuf[512] ALIGN(4096);
+static bool have_msgbuf;
+
+static u32 palette_entry(uint i, u8 pal) {
+	u8 r = i + pal, g = i + pal + 85, b = i + pal - 85;
+	return (i << 24) | (r << 16) | (g << 8) | b;
+}
+
 static void set_palette(u8 pal) {
 	debug("fbtest: set palette %u\n", pal);
-	for (uint i = 0; i < 256; i++) {
-		u8 r = i + pal, g = i + pal + 85, b = i + pal - 85;
-		uintptr_t arg = (i << 24) | (r << 16) | (g << 8) | b;
-		send1(MSG_SET_PALETTE, fbhandle, arg);
+	// One entry in arg1, and as many as fit in the message buffer.
+	const uint n = have_msgbuf ? 1 + MSG_MAX_WORDS : 1;
+	for (uint i = 0; i < 256; i += n) {
+		uint words = 0;
+		while (words + 1 < n && i + 1 + words < 256) {
+			msgbuf[words] = palette_entry(i + 1 + words, pal);
+			words++;
+		}
+		send1(msg_set_words(MSG_SET_PALETTE, words), fbhandle, palette_entry(i, pal));
 	}
 }
 
@@ -49,6 +64,8 @@ static u8 frame_buffer[W*H*BPP/8] PLACEHOLDER_SECTION ALIGN(4096);
 
 void start() {
 	__default_section_init();
+	set_priority(PRIO_BULK);
+	have_msgbuf = msgbuf_register(msgbuf);
 	log("fbtest: starting...\n");
 	{
 		ipc_arg_t arg1 = ((u64)W) << 32 | H;
@@ -17,6 +17,8 @@ enum msg_fb
 	 * For 4- or 8-bit modes, update a palette entry.
 	 *
 	 * arg1: index << 24 | r << 16 | g << 8 | b
+	 *
+	 * Any extra message words are more entries in the same format.
 	 */
 	MSG_SET_PALETTE,
 	/**
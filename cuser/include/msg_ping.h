@@ -0,0 +1,42 @@
+#ifndef __MSG_PING_H
+#define __MSG_PING_H
+
+#include "msg_syscalls.h"
+
+enum msg_ping {
+	/**
+	 * Two-argument sendrcv, used to benchmark IPC round trips.
+	 *
+	 * returns:
+	 * arg1: arg1 + 1
+	 * arg2: unchanged
+	 */
+	MSG_PING = MSG_USER,
+	/**
+	 * Same as MSG_PING, but the reply is sent with replywait, which doesn't
+	 * use the IPC fast path.
+	 */
+	MSG_PING_REPLYWAIT,
+	/**
+	 * Copy a string (MSG_STRING) to the echo server, which replies with
+	 * replywait.
+	 *
+	 * returns:
+	 * arg1: the number of bytes received
+	 */
+	MSG_PING_STRING,
+	/**
+	 * Empty the ring (see ring.h) that the echo server consumes from. The
+	 * ring is in the echo server's memory, mapped from offset 0 of the
+	 * handle, and its doorbell is RING_PING_DOORBELL.
+	 *
+	 * returns:
+	 * arg1: the number of items consumed so far
+	 */
+	MSG_PING_RING,
+};
+
+#define RING_PING_BYTES (4 * 4096)
+#define RING_PING_DOORBELL 2
+
+#endif /* __MSG_PING_H */
@@ -20,6 +20,11 @@ enum syscalls_builtins {
 	MSG_GRANT = 8,
 	MSG_PULSE = 9,
 	SYSCALL_YIELD = 10,
+	SYSCALL_SETPRIO = 11,
+	SYSCALL_PROCSTAT = 12,
+	SYSCALL_MSGBUF = 13,
+	SYSCALL_BATCH = 14,
+	SYSCALL_LAPIC = 15,
 	MSG_USER = 16,
 };
 
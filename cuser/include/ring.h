@@ -0,0 +1,121 @@
+#ifndef __RING_H
+#define __RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sb1.h>
+
+/*
+ * Single-producer single-consumer ring of fixed-size slots, in memory shared
+ * between two processes (e.g. one maps the other's pages and gets them
+ * granted on fault). Each side attaches with ring_attach on its own mapping;
+ * fresh zeroed memory is an empty ring.
+ *
+ * Items are copied in and out without any syscalls. The other side is only
+ * pulsed when the ring goes from empty to non-empty (to wake the consumer)
+ * or from full to not full (to wake the producer), so a busy pair shares one
+ * kernel entry among many items.
+ *
+ * Neither operation blocks: when ring_push or ring_pop fails, wait for the
+ * peer's doorbell pulse in the normal receive loop and try again. The pulse
+ * is latched by the kernel if it comes before the receive, so none are lost.
+ */
+
+#define RING_CACHE_LINE 64
+
+// Layout at the start of the shared memory, followed by the slots.
+struct ring_shared {
+	// Next slot to write, only written by the producer.
+	volatile uint32_t head __attribute__((aligned(RING_CACHE_LINE)));
+	// Next slot to read, only written by the consumer.
+	volatile uint32_t tail __attribute__((aligned(RING_CACHE_LINE)));
+	char slots[] __attribute__((aligned(RING_CACHE_LINE)));
+};
+
+struct ring {
+	struct ring_shared *shared;
+	uint32_t slot_size;
+	// Number of slots, a power of two.
+	uint32_t size;
+	// Handle to the other side and the pulse bit to ring it with.
+	ipc_dest_t peer;
+	uint64_t doorbell;
+	// Our copy of the other side's index, only reloaded when the ring looks
+	// full (producer) or empty (consumer), so the other side's cache line
+	// isn't touched for every item.
+	uint32_t cached;
+};
+
+// Returns false if mem_size doesn't fit even one slot after the header.
+static bool ring_attach(struct ring *r, void *mem, size_t mem_size, uint32_t slot_size, ipc_dest_t peer, uint64_t doorbell) {
+	if (!slot_size || mem_size < sizeof(struct ring_shared) + slot_size) {
+		return false;
+	}
+	r->shared = (struct ring_shared *)mem;
+	r->slot_size = slot_size;
+	size_t n = (mem_size - sizeof(struct ring_shared)) / slot_size;
+	r->size = 1;
+	while (r->size * 2 <= n) {
+		r->size *= 2;
+	}
+	r->peer = peer;
+	r->doorbell = doorbell;
+	r->cached = 0;
+	return true;
+}
+
+static void *ring_slot(struct ring *r, uint32_t index) {
+	return r->shared->slots + (size_t)(index & (r->size - 1)) * r->slot_size;
+}
+
+static uint32_t ring_load(const volatile uint32_t *index) {
+	return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+}
+
+// Publish our index, then see where the other side is. The full barrier
+// pairs with the one on the other side: either it sees our new index, or we
+// see that it's waiting for it and pulse.
+static uint32_t ring_publish(volatile uint32_t *ours, uint32_t value, const volatile uint32_t *theirs) {
+	__atomic_store_n(ours, value, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return ring_load(theirs);
+}
+
+// Add an item, returns false if the ring is full.
+static bool ring_push(struct ring *r, const void *item) {
+	const uint32_t head = r->shared->head;
+	if (head - r->cached == r->size) {
+		r->cached = ring_load(&r->shared->tail);
+		if (head - r->cached == r->size) {
+			return false;
+		}
+	}
+	memcpy(ring_slot(r, head), item, r->slot_size);
+	r->cached = ring_publish(&r->shared->head, head + 1, &r->shared->tail);
+	if (r->cached == head) {
+		// Was empty, the consumer may be waiting.
+		pulse(r->peer, r->doorbell);
+	}
+	return true;
+}
+
+// Take the oldest item, returns false if the ring is empty.
+static bool ring_pop(struct ring *r, void *item) {
+	const uint32_t tail = r->shared->tail;
+	if (r->cached == tail) {
+		r->cached = ring_load(&r->shared->head);
+		if (r->cached == tail) {
+			return false;
+		}
+	}
+	memcpy(item, ring_slot(r, tail), r->slot_size);
+	r->cached = ring_publish(&r->shared->tail, tail + 1, &r->shared->head);
+	if (r->cached - tail == r->size) {
+		// Was full, the producer may be waiting.
+		pulse(r->peer, r->doorbell);
+	}
+	return true;
+}
+
+#endif /* __RING_H */
@@ -15,7 +15,7 @@ typedef int64_t off_t; // -> sys/types.h
 enum msg_kind {
 	MSG_KIND_SEND = 0,
 	MSG_KIND_CALL = 1,
-	//MSG_KIND_REPLYWAIT = 2
+	MSG_KIND_REPLYWAIT = 2
 };
 
 enum msg_masks {
@@ -33,6 +33,69 @@ static ipc_msg_t msg_send(ipc_msg_t msg) {
 static ipc_msg_t msg_call(ipc_msg_t msg) {
 	return msg_set_kind(msg, MSG_KIND_CALL);
 }
+static ipc_msg_t msg_replywait(ipc_msg_t msg) {
+	return msg_set_kind(msg, MSG_KIND_REPLYWAIT);
+}
+/*
+ * Extra message words. A message with a word count also carries that many
+ * words from the start of the sender's message buffer, copied to the start of
+ * the receiver's (see msgbuf_register). The receiver gets the number actually
+ * copied, which is 0 unless both have a buffer.
+ */
+enum msg_words {
+	MSG_WORDS_SHIFT = 16,
+	MSG_WORDS_MASK = 0xff << MSG_WORDS_SHIFT,
+	MSG_MAX_WORDS = 64,
+};
+
+static ipc_msg_t msg_set_words(ipc_msg_t msg, unsigned words) {
+	return (msg & ~MSG_WORDS_MASK) | (((ipc_msg_t)words << MSG_WORDS_SHIFT) & MSG_WORDS_MASK);
+}
+static unsigned msg_words(ipc_msg_t msg) {
+	return (msg & MSG_WORDS_MASK) >> MSG_WORDS_SHIFT;
+}
+
+/*
+ * String copy. A message with MSG_STRING also has the kernel copy bytes from
+ * the sender's address space straight into the receiver's, as described in
+ * their message buffers (after the message words). The sender sets
+ * MSGBUF_SEND_ADDR/LEN and the receiver MSGBUF_RECV_ADDR/SIZE before the
+ * rendezvous; the receiver then gets the number of bytes copied in
+ * MSGBUF_RECV_LEN. At most MSG_MAX_STRING bytes are copied, and the copy stops
+ * early at memory the kernel can't fault in for either side.
+ *
+ * Received messages only have MSG_STRING if the receiver has a message
+ * buffer.
+ */
+enum msg_string {
+	MSG_STRING = 1 << 24,
+	MSG_MAX_STRING = 64 * 1024,
+};
+
+enum msgbuf_words {
+	MSGBUF_SEND_ADDR = MSG_MAX_WORDS,
+	MSGBUF_SEND_LEN,
+	MSGBUF_RECV_ADDR,
+	MSGBUF_RECV_SIZE,
+	MSGBUF_RECV_LEN,
+};
+
+static ipc_msg_t msg_set_string(ipc_msg_t msg) {
+	return msg | MSG_STRING;
+}
+static void msgbuf_send_string(uint64_t *buf, const void *data, size_t len) {
+	buf[MSGBUF_SEND_ADDR] = (uintptr_t)data;
+	buf[MSGBUF_SEND_LEN] = len;
+}
+static void msgbuf_recv_string(uint64_t *buf, void *dst, size_t size) {
+	buf[MSGBUF_RECV_ADDR] = (uintptr_t)dst;
+	buf[MSGBUF_RECV_SIZE] = size;
+	buf[MSGBUF_RECV_LEN] = 0;
+}
+// Length of the string received with the last MSG_STRING message.
+static size_t msgbuf_string_len(const uint64_t *buf) {
+	return buf[MSGBUF_RECV_LEN];
+}
 static uint8_t msg_code(ipc_msg_t msg) {
 	return msg & MSG_CODE_MASK;
 }
@@ -283,6 +346,52 @@ static inline uintptr_t sendrcv0(uintptr_t msg, ipc_dest_t dst)
 	return syscall1(msg_call(msg), dst);
 }
 
+/*
+ * Reply to dst (nothing if it's 0) with a plain send, then receive from *src
+ * (0 for any) like recvN. The receive source goes in r10, so the reply has at
+ * most 4 arguments.
+ *
+ * A kernel that only does the reply returns msg_replywait(0), and the receive
+ * is done with a second syscall.
+ */
+static inline ipc_msg_t replywait3(ipc_msg_t msg, ipc_dest_t dst, ipc_dest_t* src, ipc_arg_t* arg1, ipc_arg_t* arg2, ipc_arg_t* arg3)
+{
+	const ipc_dest_t from = *src;
+	register int64_t r8 __asm__("r8") = *arg3;
+	register int64_t r10 __asm__("r10") = from;
+	__asm__ __volatile__ ("syscall"
+		:	/* return value(s) */
+			"=a" (msg),
+			/* in/outputs */
+			"=D" (*src), "=S" (*arg1), "=d" (*arg2), "=r" (r8), "=r" (r10)
+		: "a" (msg_replywait(msg)), "D" (dst), "S" (*arg1), "d" (*arg2), "r" (r8), "r" (r10)
+		: "r9", "r11", "%rcx", "memory");
+	if (msg == msg_replywait(0)) {
+		*src = from;
+		return recv3(src, arg1, arg2, arg3);
+	}
+	*arg3 = r8;
+	return msg;
+}
+
+static inline ipc_msg_t replywait2(ipc_msg_t msg, ipc_dest_t dst, ipc_dest_t* src, ipc_arg_t* arg1, ipc_arg_t* arg2)
+{
+	const ipc_dest_t from = *src;
+	register int64_t r10 __asm__("r10") = from;
+	__asm__ __volatile__ ("syscall"
+		:	/* return value(s) */
+			"=a" (msg),
+			/* in/outputs */
+			"=D" (*src), "=S" (*arg1), "=d" (*arg2), "=r" (r10)
+		: "a" (msg_replywait(msg)), "D" (dst), "S" (*arg1), "d" (*arg2), "r" (r10)
+		: "r8", "r9", "r11", "%rcx", "memory");
+	if (msg == msg_replywait(0)) {
+		*src = from;
+		return recv2(src, arg1, arg2);
+	}
+	return msg;
+}
+
 
 /*****************************************************************************/
 /* Syscall wrappers. */
@@ -319,6 +428,8 @@ enum prot {
 	MAP_PHYS = 16,
 	MAP_DMA = MAP_PHYS | MAP_ANON,
 	PROT_NO_CACHE = 32,
+	// Only for grant, see grant_move.
+	GRANT_MOVE = 64,
 };
 
 static int64_t map_raw(ipc_dest_t handle, int prot, uint64_t addr, uint64_t offset, uint64_t size) {
@@ -344,14 +455,21 @@ static void map_anon(int prot, void *local_addr, uintptr_t size) {
 	}
 }
 
-static uint64_t map_dma(int prot, const volatile void *local_addr, size_t size) {
+// Allocate and map physically contiguous memory, returns the physical address
+// of the start of the region, or 0 on failure. The kernel may not support
+// allocating more than one page at a time.
+static uint64_t map_dma_aligned(int prot, const volatile void *local_addr, size_t size, size_t align) {
 	if (size) {
-		return map_raw(0, MAP_DMA | prot, (uintptr_t)local_addr, 0, size);
+		return map_raw(0, MAP_DMA | prot, (uintptr_t)local_addr, align, size);
 	} else {
 		return (uint64_t)-1;
 	}
 }
 
+static uint64_t map_dma(int prot, const volatile void *local_addr, size_t size) {
+	return map_dma_aligned(prot, local_addr, size, 0);
+}
+
 static void prefault(const volatile void* addr, int prot) {
 	syscall3(MSG_PFAULT, 0, (uintptr_t)addr, prot);
 }
@@ -360,8 +478,168 @@ static int grant(uintptr_t rcpt, const volatile void* addr, int prot) {
 	return syscall3(MSG_GRANT, rcpt, (uintptr_t)addr, prot);
 }
 
+// Like grant, but moves the page: it's unmapped here and the next access to
+// addr gets a new zeroed page. The page must be anonymous memory that hasn't
+// been shared with anyone. No copy is made and no alias is left behind.
+// Returns -1 without granting anything if the page can't be moved, a plain
+// grant still works then.
+static int grant_move(uintptr_t rcpt, void* addr, int prot) {
+	return syscall3(MSG_GRANT, rcpt, (uintptr_t)addr, prot | GRANT_MOVE);
+}
+
 static uint64_t portio(uint16_t port, uint64_t flags, uint64_t data) {
 	return syscall3(SYSCALL_IO, port, flags, data);
 }
 
+// Scheduling priorities, lower is more important. Drivers that need to
+// handle IRQs quickly should preempt everything else, bulk work should get
+// out of the way.
+enum priority {
+	PRIO_DRIVER = 1,
+	PRIO_NORMAL = 4,
+	PRIO_BULK = 6,
+};
+
+static void set_priority(enum priority prio) {
+	syscall1(SYSCALL_SETPRIO, prio);
+}
+
+enum lapic_flags {
+	// Take over the local APIC timer from the kernel.
+	LAPIC_TIMER = 1,
+};
+
+// For drivers that use the local APIC: keeps the caller on the CPU whose local
+// APIC it's talking to. Call before mapping it.
+static void lapic_claim(int flags) {
+	syscall1(SYSCALL_LAPIC, flags);
+}
+
+struct proc_stat {
+	// CPU time in TSC cycles, spent in user mode and in the kernel on the
+	// process's behalf.
+	uint64_t user_cycles;
+	uint64_t kernel_cycles;
+	uint8_t priority;
+	uint8_t base_priority;
+	uint8_t cpu;
+	char name[17];
+};
+
+// Get statistics for the index'th process. Returns 0 if there is no such
+// process.
+static int proc_stat(uint64_t index, struct proc_stat *st) {
+	uint64_t res, user, kernel, info;
+	register uint64_t r8 __asm__("r8");
+	register uint64_t r9 __asm__("r9");
+	__asm__ __volatile__ ("syscall"
+		: "=a" (res), "=D" (user), "=S" (kernel), "=d" (info),
+		  "=r" (r8), "=r" (r9)
+		: "a" (SYSCALL_PROCSTAT), "D" (index)
+		: "r10", "r11", "%rcx", "memory");
+	if (res) {
+		return 0;
+	}
+	st->user_cycles = user;
+	st->kernel_cycles = kernel;
+	st->priority = info;
+	st->base_priority = info >> 8;
+	st->cpu = info >> 16;
+	const uint64_t name[2] = { r8, r9 };
+	__builtin_memcpy(st->name, name, 16);
+	st->name[16] = 0;
+	return 1;
+}
+
+// Register a page of anonymous read-write memory (e.g. page-aligned in .bss)
+// as the message buffer, for the words after the ones in registers. Returns 0
+// if the kernel can't use it, or doesn't support message buffers.
+static int msgbuf_register(uint64_t *buf) {
+	return syscall1(SYSCALL_MSGBUF, (uintptr_t)buf) == 0;
+}
+
+/*
+ * Batches: queue up operations that don't need a reply and submit them with
+ * one syscall. The kernel runs them in order and stops at the first one that
+ * would block (e.g. a send to someone that isn't receiving), which
+ * batch_submit then does with its ordinary syscall before submitting the rest.
+ * Without kernel support, every entry is done with its ordinary syscall.
+ *
+ * Supported: sends, pulses, hmod and prefault.
+ */
+struct batch_entry {
+	ipc_msg_t msg;
+	ipc_dest_t dst;
+	ipc_arg_t arg1, arg2, arg3;
+	// 0 when done by the kernel, otherwise the return value of the syscall
+	// that did it.
+	int64_t result;
+};
+
+struct batch {
+	struct batch_entry *entries;
+	size_t count, size;
+};
+
+static void batch_init(struct batch *b, struct batch_entry *entries, size_t size) {
+	b->entries = entries;
+	b->count = 0;
+	b->size = size;
+}
+
+// Set once the kernel has said it doesn't do batches, so each batch after
+// that doesn't cost an extra kernel entry to find out again.
+static int batch_unsupported;
+
+static void batch_submit(struct batch *b) {
+	size_t done = 0;
+	while (done < b->count) {
+		if (!batch_unsupported) {
+			int64_t n = syscall2(SYSCALL_BATCH, (uintptr_t)(b->entries + done), b->count - done);
+			if (n < 0) {
+				batch_unsupported = 1;
+			} else {
+				done += n;
+			}
+		}
+		if (done < b->count) {
+			// Only the entry the kernel stopped at, then back to
+			// batching the rest. All supported operations take their
+			// arguments in the same registers as a send.
+			struct batch_entry *e = &b->entries[done++];
+			e->result = send3(e->msg, e->dst, e->arg1, e->arg2, e->arg3);
+		}
+	}
+	b->count = 0;
+}
+
+static void batch_add(struct batch *b, ipc_msg_t msg, ipc_dest_t dst, ipc_arg_t arg1, ipc_arg_t arg2, ipc_arg_t arg3) {
+	if (b->count == b->size) {
+		batch_submit(b);
+	}
+	struct batch_entry *e = &b->entries[b->count++];
+	e->msg = msg;
+	e->dst = dst;
+	e->arg1 = arg1;
+	e->arg2 = arg2;
+	e->arg3 = arg3;
+	e->result = 0;
+}
+
+static void batch_send(struct batch *b, ipc_msg_t msg, ipc_dest_t dst, ipc_arg_t arg1, ipc_arg_t arg2, ipc_arg_t arg3) {
+	batch_add(b, msg_send(msg), dst, arg1, arg2, arg3);
+}
+
+static void batch_pulse(struct batch *b, ipc_dest_t dst, uint64_t mask) {
+	batch_add(b, MSG_PULSE, dst, mask, 0, 0);
+}
+
+static void batch_hmod(struct batch *b, uintptr_t h, uintptr_t rename, uintptr_t copy) {
+	batch_add(b, MSG_HMOD, h, rename, copy, 0);
+}
+
+static void batch_prefault(struct batch *b, const volatile void *addr, int prot) {
+	batch_add(b, MSG_PFAULT, 0, (uintptr_t)addr, prot, 0);
+}
+
 #endif /* _SB1_H_ */
@@ -224,6 +224,8 @@ static void ack_irq(uintptr_t gsi) {
 
 void start() {
 	__default_section_init();
+	set_priority(PRIO_DRIVER);
+	lapic_claim(0);
 
 	map(0, MAP_PHYS | PROT_READ | PROT_WRITE | PROT_NO_CACHE,
 		lapic, apic_pbase, sizeof(lapic));
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+
+#include "common.h"
+#include "msg_ping.h"
+#include "ring.h"
+
+// IPC round-trip benchmark. Calls ipc_echo, which should be the module just
+// before this one.
+static const ipc_dest_t echo_handle = 4;
+
+#define ROUNDS 10
+#define CALLS 100000
+#define STRING_SIZE 4096
+
+static u64 msgbuf[512] ALIGN(4096);
+static u8 string[STRING_SIZE];
+static u8 ring_mem[RING_PING_BYTES] PLACEHOLDER_SECTION ALIGN(4096);
+static struct ring ring;
+static u64 ring_items;
+
+static u64 rdtsc(void) {
+	u32 lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return (u64)hi << 32 | lo;
+}
+
+static void ping(ipc_msg_t msg) {
+	for (ipc_arg_t i = 0; i < CALLS; i++) {
+		ipc_arg_t arg1 = i, arg2 = 0;
+		sendrcv2(msg, echo_handle, &arg1, &arg2);
+		if (arg1 != i + 1) {
+			printf("ipc_bench: bad reply %lu to %lu\n", arg1, i);
+			abort();
+		}
+	}
+}
+
+static void ping_string(ipc_msg_t msg) {
+	for (ipc_arg_t i = 0; i < CALLS; i++) {
+		ipc_arg_t arg1 = 0, arg2 = 0;
+		sendrcv2(msg, echo_handle, &arg1, &arg2);
+		if (arg1 != STRING_SIZE) {
+			printf("ipc_bench: echo got %lu bytes of %u\n", arg1, STRING_SIZE);
+			abort();
+		}
+	}
+}
+
+static void ping_pulse(ipc_msg_t msg) {
+	for (ipc_arg_t i = 0; i < CALLS; i++) {
+		pulse(echo_handle, 1);
+		ipc_dest_t rcpt = 0;
+		ipc_arg_t events = 0;
+		recv1(&rcpt, &events);
+		if (rcpt != echo_handle || events != 1) {
+			printf("ipc_bench: bad pulse %lx from %lx\n", events, rcpt);
+			abort();
+		}
+	}
+}
+
+// Stream items to ipc_echo through the ring, then check that it got them.
+static void ping_ring(ipc_msg_t msg) {
+	for (u64 i = 0; i < CALLS; i++) {
+		while (!ring_push(&ring, &i)) {
+			// Full, wait for the doorbell.
+			ipc_dest_t rcpt = 0;
+			ipc_arg_t events = 0;
+			recv1(&rcpt, &events);
+		}
+	}
+	ring_items += CALLS;
+	ipc_arg_t arg1 = 0, arg2 = 0;
+	sendrcv2(msg, echo_handle, &arg1, &arg2);
+	if (arg1 != ring_items) {
+		printf("ipc_bench: echo got %lu ring items of %lu\n", arg1, ring_items);
+		abort();
+	}
+}
+
+static void run(const char *name, void (*f)(ipc_msg_t), ipc_msg_t msg) {
+	for (uint round = 0; round < ROUNDS; round++) {
+		u64 start = rdtsc();
+		f(msg);
+		u64 cycles = rdtsc() - start;
+		printf("ipc_bench: %s: %lu cycles each\n", name, cycles / CALLS);
+	}
+}
+
+void start() {
+	__default_section_init();
+	printf("ipc_bench: starting.\n");
+
+	run("call", ping, MSG_PING);
+	// The reply isn't fast-pathed, but returns with sysret.
+	run("call+replywait", ping, MSG_PING_REPLYWAIT);
+	run("pulse", ping_pulse, 0);
+	if (msgbuf_register(msgbuf)) {
+		msgbuf_send_string(msgbuf, string, sizeof(string));
+		run("call+4KiB string", ping_string, msg_set_string(MSG_PING_STRING));
+	}
+	map(echo_handle, PROT_READ | PROT_WRITE, ring_mem, 0, sizeof(ring_mem));
+	prefault_range(ring_mem, sizeof(ring_mem), PROT_READ | PROT_WRITE);
+	if (ring_attach(&ring, ring_mem, sizeof(ring_mem), sizeof(u64), echo_handle, RING_PING_DOORBELL)) {
+		run("ring item", ping_ring, MSG_PING_RING);
+	}
+
+	printf("ipc_bench: done.\n");
+	for (;;) {
+		ipc_dest_t rcpt = 0;
+		recv0(rcpt);
+	}
+}
@@ -0,0 +1,75 @@
+#include <stdlib.h>
+
+#include "common.h"
+#include "msg_ping.h"
+#include "ring.h"
+
+static u64 msgbuf[512] ALIGN(4096);
+static u8 string[MSG_MAX_STRING];
+static u8 ring_mem[RING_PING_BYTES] ALIGN(4096);
+static struct ring ring;
+static u64 ring_items;
+
+static void drain_ring(ipc_dest_t peer) {
+	u64 item;
+	ring.peer = peer;
+	while (ring_pop(&ring, &item)) {
+		ring_items++;
+	}
+}
+
+// Server half of the IPC benchmark, see ipc_bench.c. Pulses are sent back
+// with the same bits, except the ring's doorbell.
+void start() {
+	__default_section_init();
+	msgbuf_register(msgbuf);
+	// Back the ring so it can be granted, the peer is known from the first
+	// doorbell.
+	prefault_range(ring_mem, sizeof(ring_mem), PROT_READ | PROT_WRITE);
+	if (!ring_attach(&ring, ring_mem, sizeof(ring_mem), sizeof(u64), 0, RING_PING_DOORBELL)) {
+		abort();
+	}
+	ipc_dest_t reply_to = 0;
+	ipc_msg_t reply = 0;
+	ipc_arg_t arg1 = 0, arg2 = 0;
+	for (;;) {
+		ipc_dest_t rcpt = 0;
+		msgbuf_recv_string(msgbuf, string, sizeof(string));
+		ipc_msg_t msg = replywait2(reply, reply_to, &rcpt, &arg1, &arg2);
+		reply_to = 0;
+		switch (msg & 0xff) {
+		case MSG_PING:
+			send2(MSG_PING, rcpt, arg1 + 1, arg2);
+			break;
+		case MSG_PING_REPLYWAIT:
+			reply_to = rcpt;
+			reply = MSG_PING_REPLYWAIT;
+			arg1++;
+			break;
+		case MSG_PING_STRING:
+			reply_to = rcpt;
+			reply = MSG_PING_STRING;
+			arg1 = msgbuf_string_len(msgbuf);
+			break;
+		case MSG_PING_RING:
+			drain_ring(rcpt);
+			reply_to = rcpt;
+			reply = MSG_PING_RING;
+			arg1 = ring_items;
+			break;
+		case MSG_PULSE:
+			if (arg1 & RING_PING_DOORBELL) {
+				drain_ring(rcpt);
+			}
+			if (arg1 & ~RING_PING_DOORBELL) {
+				pulse(rcpt, arg1 & ~RING_PING_DOORBELL);
+			}
+			break;
+		case MSG_PFAULT:
+			if (arg1 < sizeof(ring_mem)) {
+				grant(rcpt, ring_mem + arg1, arg2 & (PROT_READ | PROT_WRITE));
+			}
+			break;
+		}
+	}
+}
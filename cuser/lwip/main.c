@@ -148,11 +148,17 @@ void start() {
 
 	map(proto_handle, PROT_READ, receive_buffers, 0, sizeof(receive_buffers));
 	map(proto_handle, PROT_READ | PROT_WRITE, send_buffers, sizeof(receive_buffers), sizeof(send_buffers));
+	// Fault in all the buffers and hand out the receive buffers in one
+	// kernel entry, rather than three per buffer.
+	static struct batch_entry setup_entries[3 * NBUFS];
+	struct batch setup;
+	batch_init(&setup, setup_entries, 3 * NBUFS);
 	for (int i = 0; i < NBUFS; i++) {
-		prefault(receive_buffers[i], PROT_READ);
-		send1(MSG_ETHERNET_RECV, proto_handle, i);
-		prefault(send_buffers[i], PROT_READ | PROT_WRITE);
+		batch_prefault(&setup, receive_buffers[i], PROT_READ);
+		batch_send(&setup, MSG_ETHERNET_RECV, proto_handle, i, 0, 0);
+		batch_prefault(&setup, send_buffers[i], PROT_READ | PROT_WRITE);
 	}
+	batch_submit(&setup);
 	debug("lwip: registered protocol\n");
 	puts("lwip: starting lwIP " LWIP_VERSION_STRING "...");
 
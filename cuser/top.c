@@ -0,0 +1,53 @@
+#include "common.h"
+#include "msg_timer.h"
+
+static const ipc_dest_t apic_handle = 4;
+#define INTERVAL 1000000000/*ns*/
+#define MAX_PROCS 64
+
+static u64 prev_user[MAX_PROCS];
+static u64 prev_kernel[MAX_PROCS];
+
+static u64 rdtsc(void) {
+	u32 lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return (u64)hi << 32 | lo;
+}
+
+// Tenths of a percent of one CPU.
+static u64 permille(u64 cycles, u64 elapsed) {
+	return elapsed ? cycles * 1000 / elapsed : 0;
+}
+
+static void show(u64 elapsed) {
+	printf("top: PRI CPU  USER   SYS  NAME\n");
+	struct proc_stat st;
+	for (uint i = 0; i < MAX_PROCS && proc_stat(i, &st); i++) {
+		u64 user = permille(st.user_cycles - prev_user[i], elapsed);
+		u64 sys = permille(st.kernel_cycles - prev_kernel[i], elapsed);
+		prev_user[i] = st.user_cycles;
+		prev_kernel[i] = st.kernel_cycles;
+		printf("top: %3u %3u %3lu.%lu%% %3lu.%lu%% %s\n",
+			st.priority, st.cpu,
+			user / 10, user % 10, sys / 10, sys % 10, st.name);
+	}
+}
+
+void start() {
+	__default_section_init();
+	printf("top: starting.\n");
+
+	u64 last = rdtsc();
+	send2(MSG_REG_TIMER, apic_handle, INTERVAL, 0);
+	for (;;) {
+		ipc_dest_t rcpt = 0;
+		ipc_arg_t arg1;
+		ipc_msg_t msg = recv1(&rcpt, &arg1);
+		if ((msg & 0xff) == MSG_PULSE) {
+			u64 now = rdtsc();
+			show(now - last);
+			last = now;
+			send2(MSG_REG_TIMER, apic_handle, INTERVAL, 0);
+		}
+	}
+}
@@ -2493,6 +2493,11 @@ lodstr	rdi, 'Invalid syscall %x! proc=%p', 10
 	sc grant
 	sc pulse
 	sc yield
+	sc setprio
+	sc procstat
+	sc msgbuf
+	sc batch
+	sc lapic
 .end_table:
 N_SYSCALLS	equ (.end_table - .table) / 4
 
@@ -2507,6 +2512,31 @@ syscall_yield:
 	call	runqueue_append
 	tcall	switch_next
 
+; No priorities here, everything is round-robin.
+syscall_setprio:
+	xor	eax, eax
+	ret
+
+; No CPU time accounting either.
+syscall_procstat:
+	or	rax, -1
+	ret
+
+; Nor message buffers, messages are only copied in registers.
+syscall_msgbuf:
+	or	rax, -1
+	ret
+
+; Nor batches, the caller does each entry with its own syscall.
+syscall_batch:
+	or	rax, -1
+	ret
+
+; One CPU, and the timer is the APIC driver's already.
+syscall_lapic:
+	xor	eax, eax
+	ret
+
 syscall_write:
 %if kernel_vga_console
 	; user write: 0x0f00 | char (white on black)
@@ -2903,11 +2933,28 @@ syscall_ipc:
 	cmp	bh, MSG_KIND_CALL >> 8
 	je	syscall_call
 
-	;cmp	bh, MSG_KIND_REPLYWAIT >> 8
-	;je	syscall_replywait
+	cmp	bh, MSG_KIND_REPLYWAIT >> 8
+	je	syscall_replywait
 
 	tcall	syscall_nosys
 
+; Only the reply is done here, as a plain send, see PROC_REPLYWAIT.
+syscall_replywait:
+	and	[rax + proc.rax + 1], byte 0
+	test	rdi, rdi
+	jz	.no_reply
+	or	[rax + proc.flags], byte PROC_REPLYWAIT
+	; The reply carries rsi as its first argument, and r10 was the source
+	; to receive from, not a message word.
+	save_regs rsi
+	and	qword [rax + proc.r10], byte 0
+	jmp	syscall_send.from_other
+
+.no_reply:
+	mov	qword [rax + proc.rax], MSG_KIND_REPLYWAIT
+	swapgs
+	jmp	fastret
+
 syscall_recv:
 	mov	rax, [rbp + gseg.process]
 	save_regs rdi
@@ -3398,6 +3445,11 @@ lodstr	rdi, '%p (%x) just sent, not sendrcv', 10
 	; The sender was only sending - unblock it if necessary
 	zero	eax
 	mov	[rsi + proc.rdi], rax
+	; Tell a replywait that it still has to do the receive
+	btr	qword [rsi + proc.flags], PROC_REPLYWAIT_BIT
+	jnc	.not_replywait
+	mov	qword [rsi + proc.rax], MSG_KIND_REPLYWAIT
+.not_replywait:
 	test	[rsi + proc.flags], byte PROC_RUNNING
 	jnz	.sender_was_running
 
@@ -3582,6 +3634,10 @@ syscall_map:
 .map_dma:
 	; If this is a DMA region, allocate the memory immediately so that we
 	; can return its physical address to the caller.
+	; We can only allocate a single page, so fail bigger requests instead
+	; of giving access to whatever follows the page.
+	cmp	qword [rbx + proc.r9], 4096
+	ja	.dma_fail
 	; TODO "Unback" the page first, if it is backed.
 	call	allocate_frame
 	lea	rax, [rax - kernel_base]
@@ -3609,6 +3665,9 @@ syscall_map:
 .dma_ret:
 	mov	rax, [rbx + proc.r8]
 	ret
+.dma_fail:
+	zero	eax
+	ret
 
 ; rdi = 0
 ; rsi = vaddr
@@ -11,6 +11,8 @@ enum MapFlags {
     MAP_NOCACHE = 1 << 5,
     MAP_DMA = MAP_ANON | MAP_PHYS,
     MAP_USER = MAP_NOCACHE | MAP_DMA | MAP_RWX,
+    // Not a mapping flag: grant by moving the page instead of sharing it.
+    GRANT_MOVE = 1 << 6,
 };
 struct MapCard {
     typedef uintptr_t Key;
@@ -47,27 +49,17 @@ struct MapCard {
     }
 };
 DICT_NODE(MapCard, as_node);
-struct Sharing;
 struct Backing {
     typedef uintptr_t Key;
     DictNode<Key, Backing> node;
-    union { uintptr_t paddr; Sharing *parent; } pp;
-    DListNode<Backing> child_node;
+    uintptr_t paddr_;
+    AddressSpace *aspace;
+    // Linked into the mem::Frame for paddr, if it's RAM.
+    DListNode<Backing> frame_node;
 
-    Backing(uintptr_t vaddrFlags, uintptr_t paddr_or_parent):
-        node(vaddrFlags) {
-        pp.paddr = paddr_or_parent;
-    }
-
-    static Backing* new_phys(uintptr_t vaddrFlags, uintptr_t paddr) {
+    Backing(uintptr_t vaddrFlags, uintptr_t paddr):
+        node(vaddrFlags), paddr_(paddr) {
         assert(!(paddr & 0xfff));
-        return new Backing(vaddrFlags, paddr);
-    }
-    static Backing* new_anon(uintptr_t vaddrFlags) {
-        return new Backing(vaddrFlags | MAP_PHYS, ToPhysAddr(new u8[4096]));
-    }
-    static Backing* new_shared(uintptr_t vaddrFlags, Sharing* share) {
-        return new Backing(vaddrFlags, (uintptr_t)share);
     }
 
     u64 vaddr() const {
@@ -76,7 +68,9 @@ struct Backing {
     u16 flags() const {
         return node.key & 0xfff;
     }
-    u64 paddr() const;
+    u64 paddr() const {
+        return paddr_;
+    }
     u64 pte() const {
         return paddr() | pte_flags();
     }
@@ -95,36 +89,107 @@ struct Backing {
         return pte;
     }
 };
-DLIST_NODE(Backing, child_node);
+DLIST_NODE(Backing, frame_node);
+// A page granted from this address space to others. The receiving address
+// spaces get ordinary backings for the frame, which are tracked by the
+// frame's mappings list.
 struct Sharing {
     // Key is virtual address
     typedef uintptr_t Key;
     DictNode<Key, Sharing> node;
     uintptr_t paddr;
-    // Hmm?
-    //AddressSpace *aspace;
-    DList<Backing> children;
 
     Sharing(uintptr_t vaddr, uintptr_t paddr): node(vaddr), paddr(paddr) {
     }
-
-    Backing *new_backing(uintptr_t vaddrFlags) {
-        return children.append(Backing::new_shared(vaddrFlags, this));
-    }
 };
-u64 Backing::paddr() const {
-    return flags() & MAP_PHYS ? pp.paddr : pp.parent->paddr;
-}
 
 typedef u64 PageTable[512];
 typedef PageTable PML4;
 
 PML4 *allocate_pml4() {
     PML4 *ret = (PML4 *)new PML4;
+    (*ret)[(direct_map_base >> 39) & 511] = mem::direct_map_pml4e;
     (*ret)[511] = start32::kernel_pdp_addr | 3;
     return ret;
 }
 
+// Physically contiguous memory allocated by a DMA mapping. The region pins
+// its pages until the address space dies, then they are freed like anonymous
+// memory once nothing else maps them either.
+struct DMARegion {
+    typedef uintptr_t Key;
+    DictNode<Key, DMARegion> node;
+    size_t pages;
+
+    DMARegion(uintptr_t paddr, size_t pages): node(paddr), pages(pages) {}
+
+    uintptr_t paddr() const { return node.key; }
+};
+DICT_NODE(DMARegion, node);
+
+// Free all page tables for the user half of the address space, and the PML4
+// itself. The frames mapped by the page tables belong to the backings.
+void free_page_tables(PML4 *pml4) {
+    for (size_t i = 0; i < 256; i++) {
+        if (!((*pml4)[i] & 1)) continue;
+        auto pdp = PhysAddr<PageTable>((*pml4)[i] & -0x1000);
+        for (size_t j = 0; j < 512; j++) {
+            if (!((*pdp)[j] & 1)) continue;
+            auto pd = PhysAddr<PageTable>((*pdp)[j] & -0x1000);
+            for (size_t k = 0; k < 512; k++) {
+                if ((*pd)[k] & 1) {
+                    delete[] PhysAddr<u64>((*pd)[k] & -0x1000);
+                }
+            }
+            delete[] (u64 *)pd;
+        }
+        delete[] (u64 *)pdp;
+    }
+    delete[] (u64 *)pml4;
+}
+
+// Page tables of destroyed address spaces. A CPU may still have the CR3
+// loaded (e.g. if the last reference was dropped while running in that
+// address space), so they are only freed when switching to something else.
+struct DeadPageTables {
+    DListNode<DeadPageTables> node;
+    PML4 *pml4;
+
+    DeadPageTables(PML4 *pml4): pml4(pml4) {}
+};
+DLIST_NODE(DeadPageTables, node);
+static DList<DeadPageTables> dead_page_tables;
+
+// Implemented in cpu.h.
+// Whether any CPU currently has these page tables loaded.
+bool cr3_loaded(u64 cr3);
+// Make other CPUs that have cr3 loaded flush their TLB before running
+// anything in it. Since each address space has only one process, a CPU with
+// cr3 loaded can't be running user code in it when someone else is changing
+// its page tables, so this doesn't need to interrupt anyone.
+void flush_remote_tlbs(u64 cr3);
+// Queue a blocked process that can run again.
+void wake(Process *p);
+
+// Implemented in proc.h.
+// Wake all processes on the list, which were blocked on an address space
+// that's going away, and fail their syscalls with -1.
+void fail_waiters(DList<Process> &list);
+
+// Free dead page tables, except any that are still loaded on some CPU.
+void free_dead_page_tables() {
+    auto dead = dead_page_tables.head;
+    while (dead) {
+        auto next = dead->node.next;
+        if (!cr3_loaded(ToPhysAddr(dead->pml4))) {
+            dead_page_tables.remove(dead);
+            free_page_tables(dead->pml4);
+            delete dead;
+        }
+        dead = next;
+    }
+}
+
 PageTable *get_alloc_pt(PageTable table, u64 index, u16 flags) {
     index &= 0x1ff;
     u64 existing = table[index];
@@ -137,6 +202,15 @@ PageTable *get_alloc_pt(PageTable table, u64 index, u16 flags) {
     }
 }
 
+// Drop one reference to a frame (a mapping or a pin), freeing it if it was
+// the last one to anonymous memory.
+void put_frame(mem::Frame *frame, uintptr_t paddr) {
+    if (!--frame->mapcount && (frame->flags & mem::Frame::Anon)) {
+        frame->flags = 0;
+        mem::free(PhysAddr<void>(paddr));
+    }
+}
+
 class AddressSpace: public RefCounted<AddressSpace> {
     PML4 *pml4;
 
@@ -144,10 +218,21 @@ class AddressSpace: public RefCounted<AddressSpace> {
     Dict<Backing> backings;
     Dict<Sharing> sharings;
 
-    Dict<Handle> handles;
-    Dict<PendingPulse> pending;
+    Dict<DMARegion> dma_regions;
 
-    // Processes waiting for this address space to do something.
+    HandleTable handles;
+    Dict<PendingPulse> pending;
+    // Handles in any address space (associated or not) with us as their
+    // otherspace, which are cut off when we die.
+    DList<HandleTarget> targeted;
+
+    // Our handles that have blocked senders, see Handle::senders. Open
+    // receives take the first one and then move it last, so that one busy
+    // client can't starve all the others.
+    DList<Handle> sending;
+    // Processes in other address spaces blocked sending to us through a
+    // handle that has no peer here yet. Only an open receive can pick them
+    // up (and associate a new handle for them).
     DList<Process> waiters;
     // Processes in this address space waiting for something to happen, e.g. in
     // an open-ended receive that could be fulfilled by any other process.
@@ -161,6 +246,55 @@ public:
         name_[0] = '\0';
     }
 
+    ~AddressSpace() {
+        log(aspace, "%s: destroying address space\n", name());
+        // Processes in other address spaces may still be sending to us or
+        // waiting for our replies, with only a plain pointer to us. Their
+        // syscalls fail like with a dead peer.
+        fail_waiters(blocked);
+        fail_waiters(waiters);
+
+        while (Handle *h = handles.pop()) {
+            sending.remove(h);
+            fail_waiters(h->senders);
+            fail_waiters(h->receivers);
+            h->set_otherspace(nullptr);
+            h->dissociate();
+            delete h;
+        }
+        // Our peers were unassociated above, but copies and fresh handles
+        // in other address spaces may also point at us. (Their senders would
+        // be our own processes, which hold references to us.)
+        while (HandleTarget *t = targeted.head) {
+            Handle *h = static_cast<Handle *>(t);
+            fail_waiters(h->receivers);
+            h->set_otherspace(nullptr);
+        }
+        while (PendingPulse *p = pending.pop()) {
+            delete p;
+        }
+        while (MapCard *card = mapcards.pop()) {
+            delete card;
+        }
+        // Anonymous frames that have been shared are freed when the last
+        // other address space unmaps them.
+        while (Backing *back = backings.pop()) {
+            free_backing(back);
+        }
+        while (Sharing *share = sharings.pop()) {
+            delete share;
+        }
+        // Pages of DMA regions too, they were pinned by the region.
+        while (DMARegion *dma = dma_regions.pop()) {
+            for (size_t i = 0; i < dma->pages; i++) {
+                const uintptr_t paddr = dma->paddr() + (i << 12);
+                put_frame(mem::frame(paddr), paddr);
+            }
+            delete dma;
+        }
+        dead_page_tables.append(new DeadPageTables(pml4));
+    }
+
     void set_name(const char *newname) {
         strlcpy(name_, newname, sizeof(name_));
     }
@@ -221,17 +355,93 @@ public:
         return ToPhysAddr(pml4);
     }
 
+    void add_dma_region(uintptr_t paddr, size_t pages) {
+        for (size_t i = 0; i < pages; i++) {
+            mem::Frame *frame = mem::frame(paddr + (i << 12));
+            frame->flags |= mem::Frame::Anon;
+            frame->mapcount++;
+        }
+        dma_regions.insert(new DMARegion(paddr, pages));
+    }
+
+    Backing *add_backing(uintptr_t vaddrFlags, uintptr_t paddr) {
+        Backing *back = new Backing(vaddrFlags, paddr);
+        back->aspace = this;
+        if (mem::Frame *frame = mem::frame(paddr)) {
+            frame->mappings.append(back);
+            frame->mapcount++;
+        }
+        return backings.insert(back);
+    }
+
+    // Drop a backing that has already been removed from the backings dict.
+    // The PTE is left alone, see unmap_backing.
+    void free_backing(Backing *back) {
+        if (mem::Frame *frame = mem::frame(back->paddr())) {
+            frame->mappings.remove(back);
+            put_frame(frame, back->paddr());
+        }
+        delete back;
+    }
+
+    // Remove a backing and its PTE.
+    void unmap_backing(Backing *back) {
+        Backing *existing = backings.remove(back);
+        assert(existing == back);
+        clear_pte(back->vaddr());
+        free_backing(back);
+    }
+
+    // The backing of an anonymous page that isn't mapped anywhere else,
+    // which can be given to another address space. Null if the page at vaddr
+    // can't be moved.
+    Backing *movable_backing(uintptr_t vaddr) {
+        Backing *back = find_backing(vaddr);
+        if (!back) {
+            return nullptr;
+        }
+        mem::Frame *frame = mem::frame(back->paddr());
+        if (!frame || !(frame->flags & mem::Frame::Anon)) {
+            return nullptr;
+        }
+        // Only mapped here, per the reverse map, and not pinned either (e.g.
+        // as a message buffer), which only shows in the count.
+        if (frame->mappings.head != back || back->frame_node.next
+                || frame->mapcount != 1) {
+            return nullptr;
+        }
+        return back;
+    }
+
+    // Unmap a movable_backing without freeing the page, so it can be added
+    // to another address space with add_backing. Returns its physical
+    // address.
+    uintptr_t unmap_for_move(Backing *back) {
+        const uintptr_t paddr = back->paddr();
+        const uintptr_t vaddr = back->vaddr();
+        mem::Frame *frame = mem::frame(paddr);
+        // Hold on to the frame through the unmap.
+        frame->mapcount++;
+        unmap_backing(back);
+        frame->mapcount--;
+        // Anyone it was granted to has unmapped it since.
+        delete sharings.remove(vaddr);
+        return paddr;
+    }
+
     Backing* add_anon_backing(MapCard* card, uintptr_t vaddr) {
-        return backings.insert(Backing::new_anon(vaddr | card->flags()));
+        const uintptr_t paddr = ToPhysAddr(new u8[4096]);
+        mem::Frame *frame = mem::frame(paddr);
+        frame->flags |= mem::Frame::Anon;
+        return add_backing(vaddr | card->flags() | MAP_PHYS, paddr);
     }
 
     Backing* add_phys_backing(MapCard* card, uintptr_t vaddr) {
-        return backings.insert(Backing::new_phys(
-            vaddr | card->flags(), card->paddr(vaddr)));
+        return add_backing(vaddr | card->flags(), card->paddr(vaddr));
     }
 
     Backing& add_shared_backing(uintptr_t vaddrFlags, Sharing *sharing) {
-        return *backings.insert(sharing->new_backing(vaddrFlags));
+        return *add_backing(vaddrFlags | MAP_PHYS, sharing->paddr);
     }
 
     Backing* find_backing(uintptr_t vaddr) {
@@ -270,7 +480,31 @@ public:
         }
     }
 
+    // The physical address of a user page, for the kernel to read from or
+    // write to. Backs and maps it like a page fault would, but returns 0
+    // instead of failing if there's no suitable mapping, or if the page would
+    // have to come from a user-mode backer.
+    uintptr_t user_page(uintptr_t vaddr, bool write) {
+        const uintptr_t need = write ? MAP_W : MAP_R;
+        vaddr &= -0x1000;
+        if (vaddr >> 47) {
+            return 0;
+        }
+        Backing *back = find_backing(vaddr);
+        if (!back) {
+            uintptr_t offsetFlags, handle;
+            if (!find_mapping(vaddr, offsetFlags, handle) || handle
+                    || !(offsetFlags & need) || !(offsetFlags & MAP_DMA)) {
+                return 0;
+            }
+            back = find_add_backing(vaddr);
+            add_pte(back->vaddr(), back->pte());
+        }
+        return back->flags() & need ? back->paddr() : 0;
+    }
+
     Sharing *find_add_sharing(uintptr_t vaddr, uintptr_t paddr) {
+        vaddr &= -0x1000;
         if (auto share = sharings.find_exact(vaddr)) {
             return share;
         }
@@ -296,25 +530,43 @@ public:
         (*pt)[(vaddr >> 12) & 0x1ff] = pte;
     }
 
+    void clear_pte(uintptr_t vaddr) {
+        u64 *pte = &(*pml4)[(vaddr >> 39) & 0x1ff];
+        for (int shift = 30; shift >= 12; shift -= 9) {
+            if (!(*pte & 1)) {
+                return;
+            }
+            pte = &(*PhysAddr<PageTable>(*pte & 0xffffffffff000))[(vaddr >> shift) & 0x1ff];
+        }
+        *pte = 0;
+        if (x86::cr3() == cr3()) {
+            asm volatile("invlpg (%0)" :: "r"(vaddr) : "memory");
+        }
+        flush_remote_tlbs(cr3());
+    }
+
     Handle *new_handle(uintptr_t key, AddressSpace *other) {
-        if (Handle *old = handles.find_exact(key)) {
+        if (Handle *old = handles.find(key)) {
             delete_handle(old);
         }
-        return handles.insert(new Handle(key, other));
+        Handle *h = new Handle(key);
+        h->set_otherspace(other);
+        return handles.insert(h);
     }
 
     Handle *find_handle(uintptr_t key) const {
-        return handles.find_exact(key);
+        return handles.find(key);
     }
     void rename_handle(Handle *handle, uintptr_t new_key) {
-        handles.rekey(handle, new_key);
-    }
-    void delete_handle(Handle *handle) {
-        handle->dissociate();
-        Handle* existing = handles.remove(handle->key());
+        Handle *existing = handles.remove(handle->key());
         assert(existing == handle);
-        delete handle;
+        if (Handle *old = handles.find(new_key)) {
+            delete_handle(old);
+        }
+        handle->set_key(new_key);
+        handles.insert(handle);
     }
+    void delete_handle(Handle *handle);
 
     void pulse_handle(Handle *handle, uintptr_t events) {
         assert(events);
@@ -337,7 +589,8 @@ public:
     }
 
     // Find a process waiting to send a message to 'target' in our address
-    // space, and remove it from the waiters list.
+    // space (or to any handle if target is null), and remove it from its
+    // wait list.
     Process *pop_sender(Handle *target);
 
     // Find a process waiting to receive a message from source (our end),
@@ -353,15 +606,33 @@ public:
     // this address space, in other words you want to run this on the target
     // address space when trying to send.
     Process *pop_open_recipient();
+    // The process pop_open_recipient would return, if it's the first one
+    // blocked here. Doesn't remove it.
+    Process *peek_open_recipient() const;
 
-    // Add a process (in *another* address space) that is blocked on something
-    // in this address space.
-    void add_waiter(Process *p);
-    void remove_waiter(Process *p);
+    // Block a process (in *another* address space) sending to us through
+    // its handle h.
+    void add_sender(Process *p, Handle *h);
+    // Block a process (in this address space) receiving from h.
+    void add_receiver(Process *p, Handle *h);
 
     // Add a process (in this address space) that is blocked on something
     // unspecified.
     void add_blocked(Process *p);
     void remove_blocked(Process *p);
+
+    friend struct ::Handle;
 };
 }
+
+namespace {
+void Handle::set_otherspace(AddressSpace *p) {
+    if (otherspace) {
+        otherspace->targeted.remove(this);
+    }
+    otherspace = p;
+    if (p) {
+        p->targeted.append(this);
+    }
+}
+}
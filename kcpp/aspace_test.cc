@@ -0,0 +1,237 @@
+// Host tests for address spaces. Teardown: handles that point at the dying
+// address space are cut off, processes blocked on it get their syscalls
+// failed, and its frames are freed once nothing else maps them. Also moving
+// pages between address spaces, which relies on the frame reverse map.
+
+#include <vector>
+
+// In main.cc these headers are included inside an anonymous namespace, here
+// the address space and process types end up with external linkage.
+#pragma GCC diagnostic ignored "-Wsubobject-linkage"
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+#define HOST_KERNEL_MEM
+#include "host.h"
+#include "mboot.h"
+#include "spinlock.h"
+#include "dict.h"
+#include "dlist.h"
+#include "mem.h"
+#include "slab.h"
+#include "refcnt.h"
+#include "handle.h"
+#include "handletable.h"
+#include "aspace.h"
+#include "proc.h"
+
+// Kernel objects come from the slab allocator in "physical memory", like in
+// main.cc, so that mem::frame works for them.
+void *operator new(size_t sz) {
+    return slab::malloc(sz);
+}
+void operator delete(void *p) {
+    slab::free(p);
+}
+void operator delete(void *p, size_t) {
+    slab::free(p);
+}
+void *operator new[](size_t sz) {
+    return slab::malloc(sz);
+}
+void operator delete[](void *p) {
+    slab::free(p);
+}
+void operator delete[](void *p, size_t) {
+    slab::free(p);
+}
+
+namespace mem {
+PerCpu *percpu() {
+    return nullptr;
+}
+}
+
+namespace {
+std::vector<Process *> woken;
+}
+
+// Implemented in cpu.h in the kernel.
+namespace aspace {
+bool cr3_loaded(u64) {
+    return false;
+}
+void flush_remote_tlbs(u64) {
+}
+void wake(Process *p) {
+    woken.push_back(p);
+}
+}
+
+namespace {
+
+using namespace aspace;
+
+#define CHECK(X) do { if (!(X)) { \
+    printf("%s:%d: CHECK FAILED: %s\n", __FILE__, __LINE__, #X); \
+    abort(); } } while (0)
+
+// 16MiB of "physical memory".
+const size_t ARENA_SIZE = 16 << 20;
+
+void init_mem() {
+    host_phys_base = (u8 *)aligned_alloc(4096, ARENA_SIZE);
+    memset(host_phys_base, 0, ARENA_SIZE);
+
+    // The first page is the fake page tables for x86::cr3, put the multiboot
+    // info in the second page.
+    auto info = PhysAddr<mboot::Info>(0x1000);
+    auto mmap = PhysAddr<mboot::MemoryMapItem>(0x1800);
+    info->flags = mboot::MemoryMap;
+    info->mmap_addr = 0x1800;
+    info->mmap_length = sizeof(*mmap);
+    mmap[0] = { sizeof(*mmap) - 4, 0x100000, ARENA_SIZE - 0x100000,
+        mboot::MemoryTypeMemory };
+    mem::init(*info, 0x100000);
+}
+
+Process *new_process() {
+    return new Process(new AddressSpace());
+}
+
+// Drop the last process in an address space, which takes the address space
+// with it.
+void kill(Process *p) {
+    delete p;
+    free_dead_page_tables();
+    CHECK(!dead_page_tables.head);
+}
+
+void test_handles() {
+    Process *pa = new_process();
+    Process *pb = new_process();
+    Process *pc = new_process();
+    AddressSpace *a = pa->aspace.get();
+    AddressSpace *b = pb->aspace.get();
+    AddressSpace *c = pc->aspace.get();
+
+    pa->assoc_handles(1, pb, 1);
+    Handle *peer = a->find_handle(1);
+    // Like an hmod copy, and a fresh handle that hasn't been sent through.
+    Handle *copy = a->new_handle(2, b);
+    Handle *fresh = c->new_handle(3, b);
+    Handle *other = c->new_handle(4, a);
+    CHECK(peer->otherspace == b && copy->otherspace == b);
+
+    // pa blocks sending to b, which isn't receiving.
+    pa->set(proc::InSend);
+    b->add_sender(pa, peer);
+    // pc is a caller waiting for its reply from b.
+    pc->set(proc::InSend);
+    pc->set(proc::InRecv);
+    pc->regs.rax = 0x1234;
+    c->add_receiver(pc, fresh);
+
+    woken.clear();
+    kill(pb);
+
+    CHECK(!peer->otherspace && !peer->other);
+    CHECK(!copy->otherspace && !fresh->otherspace);
+    CHECK(other->otherspace == a);
+    CHECK(woken.size() == 2);
+    for (Process *p: woken) {
+        CHECK(p == pa || p == pc);
+        CHECK(p->regs.rax == (u64)-1);
+        CHECK(p->is_runnable() && !p->waiting_for);
+    }
+    CHECK(!fresh->receivers.head);
+
+    // Handles to the dead address space can still be deleted.
+    a->delete_handle(copy);
+    kill(pa);
+    CHECK(!other->otherspace);
+    kill(pc);
+}
+
+void test_frames() {
+    Process *pa = new_process();
+    Process *pb = new_process();
+    AddressSpace *a = pa->aspace.get();
+    AddressSpace *b = pb->aspace.get();
+
+    const uintptr_t dma = mem::allocate_contig(4, 0);
+    CHECK(dma);
+    a->add_dma_region(dma, 4);
+    a->add_backing(0x10000 | MAP_RW | MAP_PHYS, dma);
+    a->add_backing(0x11000 | MAP_RW | MAP_PHYS, dma + 0x1000);
+    // Grant the second DMA page to b.
+    Sharing *share = a->find_add_sharing(0x11000, dma + 0x1000);
+    b->add_shared_backing(0x20000 | MAP_RW, share);
+
+    MapCard card(0x30000, 0, MAP_ANON | MAP_RW);
+    const uintptr_t anon = a->add_anon_backing(&card, 0x30000)->paddr();
+    const uintptr_t lone = a->add_anon_backing(&card, 0x31000)->paddr();
+    b->add_shared_backing(0x40000 | MAP_RW, a->find_add_sharing(0x30000, anon));
+
+    kill(pa);
+
+    // Pages only a mapped are freed, DMA pages included...
+    for (uintptr_t paddr: { dma, dma + 0x2000, dma + 0x3000, lone }) {
+        CHECK(!mem::frame(paddr)->mapcount && !mem::frame(paddr)->flags);
+    }
+    // ...but b's mappings keep the granted pages.
+    for (uintptr_t paddr: { dma + 0x1000, anon }) {
+        CHECK(mem::frame(paddr)->mapcount == 1);
+        CHECK(mem::frame(paddr)->flags & mem::Frame::Anon);
+        CHECK(mem::frame(paddr)->mappings.head->aspace == b);
+    }
+
+    kill(pb);
+    for (uintptr_t paddr: { dma + 0x1000, anon }) {
+        CHECK(!mem::frame(paddr)->mapcount && !mem::frame(paddr)->flags);
+    }
+}
+
+void test_move() {
+    Process *pa = new_process();
+    Process *pb = new_process();
+    AddressSpace *a = pa->aspace.get();
+    AddressSpace *b = pb->aspace.get();
+
+    MapCard card(0x30000, 0, MAP_ANON | MAP_RW);
+    Backing *back = a->add_anon_backing(&card, 0x30000);
+    const uintptr_t paddr = back->paddr();
+    CHECK(a->movable_backing(0x30abc) == back);
+
+    Sharing *share = a->find_add_sharing(0x30abc, paddr);
+    Backing *shared = &b->add_shared_backing(0x40000 | MAP_RW, share);
+    CHECK(!a->movable_backing(0x30000));
+    b->unmap_backing(shared);
+    CHECK(a->movable_backing(0x30000) == back);
+
+    CHECK(a->unmap_for_move(back) == paddr);
+    b->add_backing(0x40000 | MAP_RW | MAP_PHYS, paddr);
+    CHECK(mem::frame(paddr)->mapcount == 1);
+    CHECK(mem::frame(paddr)->mappings.head->aspace == b);
+    // A new page at the same address can be granted, without the sharing
+    // of the old one getting in the way.
+    const uintptr_t next = a->add_anon_backing(&card, 0x30000)->paddr();
+    CHECK(a->find_add_sharing(0x30000, next)->paddr == next);
+
+    kill(pa);
+    CHECK(mem::frame(paddr)->mapcount == 1);
+    kill(pb);
+    CHECK(!mem::frame(paddr)->mapcount && !mem::frame(paddr)->flags);
+}
+
+}
+
+int main() {
+    // Keep output in order with any assertion failure messages.
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+    init_mem();
+
+    test_handles();
+    test_frames();
+    test_move();
+    printf("Tests passed\n");
+}
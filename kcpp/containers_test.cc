@@ -0,0 +1,554 @@
+// Host tests and microbenchmarks for the kernel's containers and page
+// allocator. Each test runs random operations against a reference model from
+// the standard library, then the benchmarks report ns/op at various sizes.
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+
+#define HOST_KERNEL_MEM
+#include "host.h"
+#include "mboot.h"
+#include "spinlock.h"
+#include "dict.h"
+#include "dlist.h"
+#include "refcnt.h"
+#include "mem.h"
+
+namespace mem {
+static PerCpu test_percpu;
+static bool use_percpu;
+
+PerCpu *percpu() {
+    return use_percpu ? &test_percpu : nullptr;
+}
+}
+
+namespace {
+
+// Deterministic, and cheaper than rand() so the benchmarks mostly measure the
+// containers.
+u64 rng_state = 1;
+u64 rng() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+#define CHECK(X) do { if (!(X)) { \
+    printf("%s:%d: CHECK FAILED: %s\n", __FILE__, __LINE__, #X); \
+    abort(); } } while (0)
+
+struct Item {
+    typedef uintptr_t Key;
+    DictNode<Key, Item> node;
+
+    Item(uintptr_t key): node(key) {}
+    uintptr_t key() const { return node.key; }
+};
+DICT_NODE(Item, node);
+
+typedef DictNode<uintptr_t, Item> Node;
+
+// Check the AVL and search tree invariants, return the height.
+int check_tree(const Node *node, const Node *parent) {
+    if (!node) return 0;
+    CHECK(node->parent == parent);
+    const int l = check_tree(node->left, node);
+    const int r = check_tree(node->right, node);
+    CHECK(l - r <= 1 && r - l <= 1);
+    CHECK(node->height == 1 + std::max(l, r));
+    CHECK(!node->left || node->left->key <= node->key);
+    CHECK(!node->right || node->right->key >= node->key);
+    return node->height;
+}
+
+void test_dict() {
+    Dict<Item> dict;
+    std::multimap<uintptr_t, Item *> model;
+    auto erase_item = [&](Item *item) {
+        auto range = model.equal_range(item->key());
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == item) {
+                model.erase(it);
+                return;
+            }
+        }
+        CHECK(!"item not in model");
+    };
+
+    for (int i = 0; i < 200000; i++) {
+        const uintptr_t key = rng() % 1000;
+        switch (rng() % 7) {
+        case 0:
+        case 1: {
+            Item *item = new Item(key);
+            dict.insert(item);
+            model.emplace(key, item);
+            break;
+        }
+        case 2: {
+            Item *item = dict.find_le(key);
+            auto it = model.upper_bound(key);
+            if (it == model.begin()) {
+                CHECK(!item);
+            } else {
+                CHECK(item && item->key() == (--it)->first);
+            }
+            Item *exact = dict.find_exact(key);
+            CHECK(!exact == !model.count(key));
+            CHECK(!exact || exact->key() == key);
+            break;
+        }
+        case 3:
+            if (Item *item = dict.remove(key)) {
+                CHECK(item->key() == key);
+                CHECK(!dict.contains(item));
+                erase_item(item);
+                delete item;
+            } else {
+                CHECK(!model.count(key));
+            }
+            break;
+        case 4: {
+            const uintptr_t end = key + rng() % 20;
+            Item *item = dict.remove_range_exclusive(key, end);
+            auto it = model.upper_bound(key);
+            if (it == model.end() || it->first >= end) {
+                CHECK(!item);
+            } else {
+                CHECK(item && item->key() == it->first);
+                erase_item(item);
+                delete item;
+            }
+            break;
+        }
+        case 5:
+            if (!model.empty()) {
+                auto it = model.begin();
+                std::advance(it, rng() % std::min<size_t>(model.size(), 32));
+                Item *item = it->second;
+                CHECK(dict.contains(item));
+                model.erase(it);
+                if (rng() & 1) {
+                    Item *removed = dict.remove(item);
+                    CHECK(removed == item);
+                    delete item;
+                } else {
+                    const uintptr_t new_key = rng() % 1000;
+                    dict.rekey(item, new_key);
+                    model.emplace(new_key, item);
+                }
+            }
+            break;
+        case 6:
+            if (Item *item = dict.pop()) {
+                CHECK(item->key() == model.begin()->first);
+                erase_item(item);
+                delete item;
+            } else {
+                CHECK(model.empty());
+            }
+            break;
+        }
+        if (i % 1024 == 0) {
+            check_tree(dict.root, nullptr);
+        }
+    }
+    check_tree(dict.root, nullptr);
+    while (Item *item = dict.pop()) {
+        erase_item(item);
+        delete item;
+    }
+    CHECK(model.empty());
+}
+
+struct Elem {
+    DListNode<Elem> node;
+    int value;
+};
+
+void test_dlist() {
+    DList<Elem> list;
+    std::list<Elem *> model;
+    std::vector<Elem *> members;
+
+    for (int i = 0; i < 100000; i++) {
+        switch (rng() % 4) {
+        case 0:
+        case 1: {
+            Elem *e = new Elem();
+            e->value = i;
+            list.append(e);
+            model.push_back(e);
+            members.push_back(e);
+            break;
+        }
+        case 2:
+            if (!members.empty()) {
+                const size_t j = rng() % members.size();
+                Elem *e = members[j];
+                members[j] = members.back();
+                members.pop_back();
+                list.remove(e);
+                CHECK(!list.contains(e));
+                model.remove(e);
+                delete e;
+            }
+            break;
+        case 3:
+            if (Elem *e = list.pop()) {
+                CHECK(e == model.front());
+                model.pop_front();
+                members.erase(std::find(members.begin(), members.end(), e));
+                delete e;
+            } else {
+                CHECK(model.empty());
+            }
+            break;
+        }
+        if (i % 1024 == 0) {
+            auto it = model.begin();
+            for (Elem *e: list) {
+                CHECK(it != model.end() && *it == e);
+                ++it;
+            }
+            CHECK(it == model.end());
+            CHECK(list.tail == (model.empty() ? nullptr : model.back()));
+        }
+    }
+    while (Elem *e = list.pop()) {
+        delete e;
+    }
+}
+
+int live_objects;
+
+struct Counted: public RefCounted<Counted> {
+    Counted() { live_objects++; }
+    ~Counted() { live_objects--; }
+};
+
+void test_refcnt() {
+    const size_t N = 64;
+    std::vector<RefCnt<Counted>> refs(N);
+    std::map<Counted *, int> model;
+    auto drop = [&](Counted *p) {
+        if (p && !--model[p]) {
+            model.erase(p);
+        }
+    };
+
+    for (int i = 0; i < 100000; i++) {
+        RefCnt<Counted> &ref = refs[rng() % N];
+        RefCnt<Counted> &other = refs[rng() % N];
+        switch (rng() % 4) {
+        case 0: {
+            Counted *p = new Counted();
+            drop(ref.get());
+            model[p]++;
+            ref.reset_addref(p);
+            break;
+        }
+        case 1:
+            drop(ref.get());
+            ref.reset();
+            break;
+        case 2:
+            if (&ref != &other) {
+                if (other.get()) model[other.get()]++;
+                drop(ref.get());
+                ref = other;
+            }
+            break;
+        case 3:
+            if (&ref != &other) {
+                drop(ref.get());
+                ref = static_cast<RefCnt<Counted>&&>(other);
+                CHECK(!other.get());
+            }
+            break;
+        }
+        CHECK(live_objects == (int)model.size());
+        for (auto &m: model) {
+            CHECK(m.first->get_refcount() == (u32)m.second);
+        }
+    }
+    for (auto &ref: refs) {
+        ref.reset();
+    }
+    CHECK(live_objects == 0);
+}
+
+// 64MiB of "physical memory", with a hole to get more than one region.
+const size_t ARENA_SIZE = 64 << 20;
+const uintptr_t HOLE_START = 40 << 20, HOLE_END = 44 << 20;
+
+void init_mem() {
+    host_phys_base = (u8 *)aligned_alloc(4096, ARENA_SIZE);
+    memset(host_phys_base, 0, ARENA_SIZE);
+
+    // The first page is the fake page tables for x86::cr3, put the multiboot
+    // info in the second page.
+    auto info = PhysAddr<mboot::Info>(0x1000);
+    auto mmap = PhysAddr<mboot::MemoryMapItem>(0x1800);
+    info->flags = mboot::MemoryMap;
+    info->mmap_addr = 0x1800;
+    info->mmap_length = 3 * sizeof(*mmap);
+    mmap[0] = { sizeof(*mmap) - 4, 0, 0xa0000, mboot::MemoryTypeMemory };
+    mmap[1] = { sizeof(*mmap) - 4, 0x100000, HOLE_START - 0x100000,
+        mboot::MemoryTypeMemory };
+    mmap[2] = { sizeof(*mmap) - 4, HOLE_END, ARENA_SIZE - HOLE_END,
+        mboot::MemoryTypeMemory };
+    mem::init(*info, 0x100000);
+}
+
+// Return all pages cached in the magazine to the global allocator.
+void drain_percpu() {
+    mem::PerCpu &pc = mem::test_percpu;
+    mem::put_global(pc.head, pc.count);
+    pc.head = nullptr;
+    pc.count = 0;
+    mem::put_global(pc.zeroed, pc.zeroed_count);
+    pc.zeroed = nullptr;
+    pc.zeroed_count = 0;
+}
+
+void test_mem() {
+    const u32 total = mem::free_pages;
+    CHECK(total == mem::total_pages);
+    // Reserved space (low memory, page tables, frame array) must never be
+    // handed out.
+    const uintptr_t min_paddr = 0x100000;
+
+    struct Alloc {
+        uintptr_t paddr;
+        size_t pages;
+        bool contig;
+    };
+    std::vector<Alloc> allocs;
+    std::set<uintptr_t> used;
+
+    auto check_new = [&](uintptr_t paddr, size_t pages, bool zeroed) {
+        CHECK(paddr >= min_paddr && !(paddr & 0xfff));
+        CHECK(paddr + (pages << 12) <= ARENA_SIZE);
+        CHECK(paddr >= HOLE_END || paddr + (pages << 12) <= HOLE_START);
+        for (size_t i = 0; i < pages; i++) {
+            CHECK(used.insert(paddr + (i << 12)).second);
+            u64 *p = PhysAddr<u64>(paddr + (i << 12));
+            if (zeroed) {
+                CHECK(p[0] == 0 && p[511] == 0);
+            }
+            // Make sure later zeroed allocations actually get zeroed.
+            p[0] = p[511] = 0xdeadbeef;
+        }
+        allocs.push_back({ paddr, pages, false });
+    };
+
+    for (int i = 0; i < 100000; i++) {
+        mem::use_percpu = rng() % 4;
+        switch (rng() % 5) {
+        case 0:
+            check_new(ToPhysAddr(mem::malloc(4096)), 1, true);
+            break;
+        case 1:
+            check_new(ToPhysAddr(mem::malloc_dirty()), 1, false);
+            break;
+        case 2: {
+            const size_t pages = 1 + rng() % 40;
+            const size_t align = rng() % 2 ? 0 : 4096 << (rng() % 6);
+            const uintptr_t paddr = mem::allocate_contig(pages, align);
+            if (paddr) {
+                CHECK(!align || !(paddr & (align - 1)));
+                check_new(paddr, pages, true);
+                allocs.back().contig = true;
+            }
+            break;
+        }
+        case 3:
+        case 4:
+            if (!allocs.empty()) {
+                const size_t j = rng() % allocs.size();
+                const Alloc a = allocs[j];
+                allocs[j] = allocs.back();
+                allocs.pop_back();
+                for (size_t k = 0; k < a.pages; k++) {
+                    used.erase(a.paddr + (k << 12));
+                }
+                if (a.contig) {
+                    mem::free_contig(a.paddr, a.pages);
+                } else {
+                    mem::free(PhysAddr<void>(a.paddr));
+                }
+            }
+            break;
+        }
+        if (rng() % 16 == 0) {
+            mem::test_percpu.zero_one();
+        }
+    }
+    for (const Alloc &a: allocs) {
+        if (a.contig) {
+            mem::free_contig(a.paddr, a.pages);
+        } else {
+            mem::free(PhysAddr<void>(a.paddr));
+        }
+    }
+    drain_percpu();
+    CHECK(mem::free_pages == total);
+    // Everything should have merged back into the biggest possible blocks,
+    // i.e. no free block has a free buddy of the same size.
+    for (unsigned order = 0; order <= mem::MAX_ORDER; order++) {
+        for (auto *b: mem::free_area[order]) {
+            const uintptr_t pfn = mem::block_pfn(b);
+            CHECK(mem::frames[pfn].order == order + 1);
+            if (order < mem::MAX_ORDER) {
+                const uintptr_t buddy = pfn ^ (1 << order);
+                CHECK(buddy >= mem::max_pfn
+                        || mem::frames[buddy].order != order + 1);
+            }
+        }
+    }
+    mem::use_percpu = false;
+}
+
+double per_op(u64 start, size_t n) {
+    return double(host_nsec() - start) / n;
+}
+
+void bench_dict(size_t n) {
+    Dict<Item> dict;
+    std::vector<Item *> items(n);
+    for (size_t i = 0; i < n; i++) {
+        items[i] = new Item(rng());
+    }
+
+    u64 start = host_nsec();
+    for (Item *item: items) {
+        dict.insert(item);
+    }
+    const double insert = per_op(start, n);
+
+    const size_t lookups = std::max<size_t>(n, 100000);
+    uintptr_t sum = 0;
+    start = host_nsec();
+    for (size_t i = 0; i < lookups; i++) {
+        sum += (uintptr_t)dict.find_le(rng());
+    }
+    const double find_le = per_op(start, lookups);
+    CHECK(sum || n < 100);
+
+    start = host_nsec();
+    for (size_t i = 0; i < n / 2; i++) {
+        Item *removed = dict.remove(items[i]);
+        CHECK(removed == items[i]);
+    }
+    const double remove = per_op(start, n / 2);
+
+    start = host_nsec();
+    while (dict.pop()) {}
+    const double pop = per_op(start, n - n / 2);
+
+    printf("Dict  %6zu: insert %6.1f  find_le %6.1f  remove %6.1f  pop %6.1f ns/op\n",
+            n, insert, find_le, remove, pop);
+    for (Item *item: items) {
+        delete item;
+    }
+}
+
+void bench_dlist(size_t n) {
+    DList<Elem> list;
+    std::vector<Elem> elems(n);
+
+    u64 start = host_nsec();
+    for (Elem &e: elems) {
+        list.append(&e);
+    }
+    const double append = per_op(start, n);
+
+    start = host_nsec();
+    for (size_t i = 0; i < n / 2; i++) {
+        list.remove(&elems[(i * 7919) % n]);
+    }
+    const double remove = per_op(start, n / 2);
+
+    start = host_nsec();
+    size_t popped = 0;
+    while (list.pop()) popped++;
+    const double pop = per_op(start, popped ? popped : 1);
+
+    printf("DList %6zu: append %6.1f  remove %6.1f  pop %6.1f ns/op\n",
+            n, append, remove, pop);
+}
+
+void bench_refcnt() {
+    const size_t n = 1000000;
+    Counted *obj = new Counted();
+    RefCnt<Counted> ref(obj);
+    u64 start = host_nsec();
+    for (size_t i = 0; i < n; i++) {
+        RefCnt<Counted> tmp(obj);
+        asm volatile("" ::: "memory");
+    }
+    printf("RefCnt: addref+release %.1f ns/op\n", per_op(start, n));
+}
+
+void bench_mem() {
+    // Small batches should mostly hit in the per-CPU magazine, big batches
+    // go through the global allocator either way.
+    static void *pages[1000];
+    for (size_t n: { 16, 1000 }) {
+        for (int percpu = 0; percpu < 2; percpu++) {
+            mem::use_percpu = percpu;
+            const size_t rounds = 100000 / n;
+            u64 start = host_nsec();
+            for (size_t round = 0; round < rounds; round++) {
+                for (size_t i = 0; i < n; i++) {
+                    pages[i] = mem::malloc_dirty();
+                }
+                for (size_t i = 0; i < n; i++) {
+                    mem::free(pages[i]);
+                }
+            }
+            printf("mem: malloc_dirty+free %.1f ns/op (%s, batches of %zu)\n",
+                    per_op(start, rounds * n),
+                    percpu ? "per-CPU" : "global", n);
+        }
+    }
+    drain_percpu();
+
+    u64 start = host_nsec();
+    for (size_t i = 0; i < 10000; i++) {
+        uintptr_t paddr = mem::allocate_contig(8, 0);
+        mem::free_contig(paddr, 8);
+    }
+    printf("mem: allocate_contig+free_contig of 8 pages %.1f ns/op\n",
+            per_op(start, 10000));
+    mem::use_percpu = false;
+}
+
+}
+
+int main() {
+    // Keep output in order with any assertion failure messages.
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+    init_mem();
+
+    test_dict();
+    test_dlist();
+    test_refcnt();
+    test_mem();
+    printf("Tests passed\n");
+
+    for (size_t n = 10; n <= 100000; n *= 10) {
+        bench_dict(n);
+    }
+    for (size_t n = 10; n <= 100000; n *= 10) {
+        bench_dlist(n);
+    }
+    bench_refcnt();
+    bench_mem();
+}
@@ -3,13 +3,36 @@ namespace cpu {
 namespace {
 extern "C" void fastret(Process *p, u64 rax) NORETURN;
 extern "C" void slowret(Process *p) NORETURN;
+extern "C" void msgret(Process *p) NORETURN;
 extern "C" void syscall_entry_stub();
 extern "C" void syscall_entry_compat();
 }
 
-struct Cpu;
 void idle(Cpu *) NORETURN;
 
+// The boot page tables, which map only the kernel. Loaded when idle if the
+// previous process's page tables need to be freed.
+static u64 kernel_cr3;
+
+// The big kernel lock. Everything in the kernel except the page allocator's
+// global lists (see mem::global_lock) and a CPU's own Cpu struct is protected
+// by this, including all address spaces, processes and other CPUs' run
+// queues. It's taken on every entry from user mode or idle (syscall and
+// int_entry) and released just before returning to user mode (switch_to) or
+// halting (idle).
+static SpinLock kernel_lock;
+
+static Cpu *cpus[mem::MAX_CPUS];
+static size_t n_cpus;
+
+// IRQs are forwarded to one user-mode process, whichever CPU they arrive on.
+static Process *irq_process;
+static u64 irq_delayed[4];
+
+// GS base of a CPU that doesn't have a Cpu yet, so that get_cpu_specific
+// returns null.
+static Cpu *const no_cpu = nullptr;
+
 Cpu &getcpu() {
     return *(Cpu *)x86::get_cpu_specific();
 }
@@ -40,31 +63,106 @@ struct Cpu {
     SavedRegs *kernel_reg_save_pointer;
     // END OF ASSEMBLY-SHARED FIELDS
 
-    // mem::PerCpu memory
-    DList<Process> runqueue;
-    Process *irq_process;
-    u64 irq_delayed[4];
+    mem::PerCpu memory;
+    // Like everything else the run queues are protected by the kernel lock.
+    // One per priority, with a bit set in ready for each non-empty queue so
+    // that finding the next process is O(1). The owner pops from the head,
+    // other CPUs steal from the tail.
+    DList<Process> runqueue[proc::NPRIO];
+    u32 ready;
+    u32 nqueued;
+    // Set while halted in idle with nothing to run.
+    bool halted;
+    // A wake-up IPI has been sent, but the CPU hasn't looked at its run
+    // queue since.
+    bool woken;
+
+    // Processes switched to, and how many of those last ran on another CPU.
+    u64 switches, migrations;
+    // Processes stolen from other CPUs' run queues.
+    u64 steals;
+    // IPC transfers that switched directly to the other process, and how
+    // many of those were done by the fast path (see syscall_ipc_fast).
+    u64 handoffs, fastpaths;
+    // Wake-up IPIs received.
+    u64 wakeups;
+    // Timer ticks, and how many of those preempted the running process.
+    u64 ticks, preemptions;
+    // TSC when we last entered or left the kernel, and the process the
+    // kernel is running on behalf of since then (if not idle).
+    u64 last_tsc;
+    Process *charged;
+    u64 idle_cycles;
+
+    u8 id;
+    u8 apic_id;
+    // The currently loaded page tables.
+    u64 cr3;
+    // A user-mode driver has taken over the local APIC timer (SYS_LAPIC), so
+    // there might be no ticks to preempt the running process.
+    bool timer_claimed;
+    // Set when page table entries have been removed in cr3 by another CPU,
+    // before switching to it again we need to flush the TLB.
+    bool flush_tlb;
 
     SavedRegs kernel_reg_save;
 
+    // Each CPU needs its own TSS for the stack pointer used when entering
+    // the kernel from user mode, and thus its own GDT. The rest is copied
+    // from the boot GDT.
+    static const size_t GDT_ENTRIES = 12;
+    u64 gdt[GDT_ENTRIES];
+    x86::TSS tss;
+
+    static const size_t STACK_SIZE = 4096;
+
     // Assume everything else is 0-initialized
-    // FIXME There's already a stack allocated by the boot loader, a bit
-    // wasteful to allocate a new one. Non-first CPUs might need this code
-    // though?
+    // The stack is used for all entries into the kernel (syscall, interrupts
+    // from user mode and interrupts while idle). None of those return, so
+    // each entry starts over at the top.
     Cpu():
         self(this),
-        stack(new u8[4096]),
+        stack(new u8[STACK_SIZE] + STACK_SIZE),
         kernel_reg_save_pointer(&kernel_reg_save) {
+        mem::add_cpu(&memory);
     }
     Cpu(Cpu&) = delete;
     Cpu& operator=(Cpu&) = delete;
 
+    // Called on the CPU itself. APs hold the kernel lock while starting, the
+    // boot CPU is still alone when it gets here.
     void start() {
+        using x86::seg;
+
+        const x86::gdtr &boot_gdt = start32::gdtr;
+        assert(boot_gdt.limit < sizeof(gdt));
+        memcpy(gdt, (const void *)boot_gdt.base, boot_gdt.limit + 1);
+        tss.rsp0 = (u64)stack;
+        tss.iopb = sizeof(tss);
+        x86::set_tss_descriptor(gdt + seg::tss64 / 8, &tss);
+        x86::lgdt(x86::gdtr { sizeof(gdt) - 1, (u64)gdt });
+        x86::ltr(seg::tss64);
+
         setup_msrs((u64)this);
+        lapic::init();
+        lapic::start_timer();
+        apic_id = lapic::id();
+        cr3 = kernel_cr3 = x86::cr3();
+        last_tsc = x86::rdtsc();
+
+        assert(n_cpus < mem::MAX_CPUS);
+        id = n_cpus;
+        cpus[id] = this;
+        __atomic_store_n(&n_cpus, id + 1, __ATOMIC_RELEASE);
     }
 
     NORETURN void run() {
-        if (Process *p = runqueue.pop()) {
+        halted = woken = false;
+        Process *p = pop();
+        if (!p) {
+            p = steal();
+        }
+        if (p) {
             log(switch, "run: popped %s\n", p->name());
             assert(p->is_queued());
             p->unset(proc::Queued);
@@ -74,22 +172,175 @@ struct Cpu {
         }
     }
 
+    // Queues with a priority of at least prio (i.e. numerically lower or
+    // equal) that have something in them.
+    u32 ready_at(u8 prio) const {
+        return ready & ((2u << prio) - 1);
+    }
+
+    void remove(Process *p) {
+        const u8 prio = p->queued_priority;
+        DList<Process> &q = runqueue[prio];
+        q.remove(p);
+        if (!q.head) {
+            ready &= ~(1u << prio);
+        }
+        nqueued--;
+    }
+
+    Process *pop() {
+        if (!ready) {
+            return nullptr;
+        }
+        Process *p = runqueue[__builtin_ctz(ready)].head;
+        remove(p);
+        return p;
+    }
+
+    // Take a process from the CPU with the most queued work, if any CPU has
+    // more than it's about to run itself.
+    Process *steal() {
+        Cpu *victim = nullptr;
+        for (size_t i = 0; i < n_cpus; i++) {
+            Cpu *c = cpus[i];
+            if (c == this) {
+                continue;
+            }
+            // An idle CPU with a single process queued will get around to
+            // it as soon as it wakes up.
+            const u32 spare = c->process ? c->nqueued : c->nqueued - !!c->nqueued;
+            if (spare && (!victim || c->nqueued > victim->nqueued)) {
+                victim = c;
+            }
+        }
+        if (!victim) {
+            return nullptr;
+        }
+        // Steal the highest priority work, but from the tail, what the victim
+        // would run last at that priority.
+        for (u32 ready = victim->ready; ready; ready &= ready - 1) {
+            const u8 prio = __builtin_ctz(ready);
+            for (Process *p = victim->runqueue[prio].tail; p; p = p->node.prev) {
+                if (!p->pinned) {
+                    log(steal, "CPU %u steals %s from CPU %u (%u queued)\n",
+                            id, p->name(), victim->id, victim->nqueued);
+                    victim->remove(p);
+                    steals++;
+                    return p;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    void wake() {
+        if (!woken) {
+            woken = true;
+            wakeups++;
+            lapic::send_ipi(apic_id, lapic::ICR_FIXED | lapic::WAKE_VECTOR);
+        }
+    }
+
+    // Wake some idle CPU so that it can steal work from us.
+    void wake_idle() {
+        for (size_t i = 0; i < n_cpus; i++) {
+            Cpu *c = cpus[i];
+            if (c != this && c->halted && !c->woken) {
+                c->wake();
+                return;
+            }
+        }
+    }
+
     void queue(Process *p) {
+        if (p->pinned && p->pinned != this) {
+            p->pinned->queue(p);
+            return;
+        }
         log(runqueue, "queue %s. queued=%d flags=%lu\n", p->name(), p->is_queued(), p->flags);
         assert(p->is_runnable());
         if (!p->is_queued()) {
             p->set(proc::Queued);
-            runqueue.append(p);
+            // Lent priorities can change while queued, so remember which
+            // queue it's on.
+            p->queued_priority = p->priority;
+            runqueue[p->priority].append(p);
+            ready |= 1u << p->priority;
+            nqueued++;
+            if (this != &getcpu()) {
+                // It might be idle, or running something less important.
+                // Equal priority can wait for the next tick.
+                if (!process || p->priority < process->priority
+                        || timer_claimed) {
+                    wake();
+                }
+            } else if (nqueued > 1) {
+                // More than we'll run next, let someone else help.
+                wake_idle();
+            }
+        }
+    }
+
+    // Timer tick, interrupting p (or idle). If p has used up its timeslice and
+    // anything else with the same or higher priority is waiting, let that run.
+    NORETURN void tick(Process *p) {
+        ticks++;
+        if (p) {
+            if (p->slice_left) {
+                p->slice_left--;
+            }
+            if (p->slice_left || !ready_at(p->priority)) {
+                switch_to(p);
+            }
+            log(switch, "tick: preempting %s\n", p->name());
+            preemptions++;
+            queue(p);
         }
+        run();
+    }
+
+    // Charge the time since the last kernel entry/exit and start over.
+    u64 elapsed() {
+        const u64 now = x86::rdtsc();
+        const u64 res = now - last_tsc;
+        last_tsc = now;
+        return res;
     }
 
     void leave(Process *p) {
         assert(p == process);
         log(runqueue, "leaving %s\n", p->name());
         p->unset(proc::Running);
+        p->user_cycles += elapsed();
+        charged = p;
         process = NULL;
     }
 
+    // Interrupted while idle.
+    void leave_idle() {
+        idle_cycles += elapsed();
+        charged = nullptr;
+    }
+
+    // About to leave the kernel, for user mode or idle.
+    void charge_kernel() {
+        const u64 cycles = elapsed();
+        if (charged) {
+            charged->kernel_cycles += cycles;
+            charged = nullptr;
+        }
+    }
+
+    void load_cr3(u64 new_cr3) {
+        if (new_cr3 != cr3) {
+            cr3 = new_cr3;
+            x86::set_cr3(new_cr3);
+        } else if (flush_tlb) {
+            x86::flush_tlb();
+        }
+        flush_tlb = false;
+    }
+
     NORETURN void switch_to(Process *p) {
         log(switch, "switch_to %s rip=%#lx fastret=%d queued=%d\n",
                 p->name(), p->rip, p->is(proc::FastRet), p->is(proc::Queued));
@@ -97,19 +348,59 @@ struct Cpu {
         assert(!process);
         assert(!p->is(proc::Running));
         assert(p->is_runnable());
-        p->set(proc::Running);
-        if (process != p) {
-            process = p;
-            x86::set_cr3(p->cr3);
+        if (p->pinned && p->pinned != this) {
+            p->pinned->queue(p);
+            run();
         }
+        enter(p);
         if (p->is(proc::FastRet)) {
             p->unset(proc::FastRet);
+            if (p->is(proc::MsgRegs)) {
+                p->unset(proc::MsgRegs);
+                msgret(p);
+            }
             fastret(p, p->regs.rax);
         } else {
+            p->unset(proc::MsgRegs);
             slowret(p);
         }
     }
 
+    // Everything in switching to p except actually returning to it, which
+    // must follow immediately since the kernel lock is released.
+    void enter(Process *p) {
+        p->set(proc::Running);
+        process = p;
+        if (!p->slice_left) {
+            p->slice_left = proc::SLICE_TICKS;
+        }
+        switches++;
+        if (p->last_cpu != this) {
+            if (p->last_cpu) {
+                migrations++;
+            }
+            p->last_cpu = this;
+        }
+        load_cr3(p->cr3);
+        if (aspace::dead_page_tables.head) {
+            aspace::free_dead_page_tables();
+        }
+        charge_kernel();
+        kernel_lock.unlock();
+    }
+
+    // Switch directly to a process that was just made runnable by IPC,
+    // without going through the run queue, unless something more important
+    // is waiting there.
+    NORETURN void handoff(Process *p) {
+        if (p->priority && ready_at(p->priority - 1)) {
+            queue(p);
+            run();
+        }
+        handoffs++;
+        switch_to(p);
+    }
+
     // TODO Using fastret here should be guaranteed possible, so we can avoid
     // going through memory for rax. Note that we don't always return to the
     // same process that called (e.g. in IPC cases when the old is blocked and
@@ -121,6 +412,11 @@ struct Cpu {
         switch_to(p);
     }
 
+    void stat() const {
+        printf("CPU %u: %u queued, %lu switches, %lu migrations, %lu steals, %lu handoffs (%lu fast), %lu wakeups, %lu ticks, %lu preemptions\n",
+                id, nqueued, switches, migrations, steals, handoffs, fastpaths, wakeups, ticks, preemptions);
+    }
+
     void dump_stack(u64 *start, u64 *end) {
         while (start < end) {
             printf("%p: %16lx\n", start, *start);
@@ -135,13 +431,81 @@ struct Cpu {
     }
 };
 
-void idle(Cpu *cpu) {
-    log(idle, "idle\n");
-    cpu->process = NULL;
+// Switch to the top of the CPU's stack and call fn, which must not return.
+NORETURN void run_on_stack(Cpu *cpu, void (*fn)(Cpu *)) {
+    asm volatile("movq %0, %%rsp; call *%1; ud2"
+            :: "r"(cpu->stack), "r"(fn), "D"(cpu) : "memory");
+    __builtin_unreachable();
+}
+
+NORETURN void idle_loop(Cpu *cpu) {
+    // Pre-zero pages while there's nothing else to do. Interrupts are let in
+    // between pages, any interrupt will just restart the idle loop.
+    while (cpu->memory.zero_one()) {
+        asm volatile("sti; nop; cli" ::: "memory");
+    }
     asm volatile("sti; hlt" ::: "memory");
     // We should have entered an interrupt handler which would not "return"
     // here but rather just re-idle.
     abort("idle returned");
 }
 
+void idle(Cpu *cpu) {
+    log(idle, "idle\n");
+    cpu->process = NULL;
+    cpu->halted = true;
+    if (aspace::dead_page_tables.head) {
+        cpu->load_cr3(kernel_cr3);
+        aspace::free_dead_page_tables();
+    }
+    cpu->charge_kernel();
+    kernel_lock.unlock();
+    // Interrupts taken while idle don't return either, so start over from
+    // the top of the stack instead of nesting deeper for every interrupt.
+    run_on_stack(cpu, idle_loop);
+}
+
+void stat() {
+    for (size_t i = 0; i < n_cpus; i++) {
+        cpus[i]->stat();
+    }
+}
+
+// Called first thing on each CPU, before anything might allocate memory.
+void early_init() {
+    x86::msr::wrmsr(x86::msr::GSBASE, (u64)&no_cpu);
+}
+
+}
+
+namespace mem {
+PerCpu *percpu() {
+    cpu::Cpu *cpu = (cpu::Cpu *)x86::get_cpu_specific();
+    return cpu ? &cpu->memory : nullptr;
+}
+}
+
+namespace aspace {
+bool cr3_loaded(u64 cr3) {
+    for (size_t i = 0; i < cpu::n_cpus; i++) {
+        if (cpu::cpus[i]->cr3 == cr3) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void flush_remote_tlbs(u64 cr3) {
+    cpu::Cpu *self = &cpu::getcpu();
+    for (size_t i = 0; i < cpu::n_cpus; i++) {
+        cpu::Cpu *c = cpu::cpus[i];
+        if (c != self && c->cr3 == cr3) {
+            c->flush_tlb = true;
+        }
+    }
+}
+
+void wake(Process *p) {
+    cpu::getcpu().queue(p);
+}
 }
@@ -5,13 +5,18 @@ DictNode<typename T::Key, T> *node_from_item(T *c) { return &c->node; }
 template <class K, class V> struct DictNode
 {
     K key;
-    //DictNode* left;
+    DictNode* left;
     DictNode* right;
+    DictNode* parent;
+    // Height of the subtree rooted here, 1 for a leaf.
+    u8 height;
 
     DictNode(K key):
         key(key),
-        //left(nullptr),
-        right(nullptr) {}
+        left(nullptr),
+        right(nullptr),
+        parent(nullptr),
+        height(0) {}
 
     static DictNode *node(V *item) {
         return node_from_item(item);
@@ -23,6 +28,8 @@ template <class K, class V> struct DictNode
         return (V*)((u8*)this - node_offset());
     }
 };
+// Intrusive AVL tree. Duplicate keys are allowed, which of the duplicates is
+// found by a lookup is unspecified.
 template <class V, class K = typename V::Key> struct Dict
 {
     typedef DictNode<K, V> Node;
@@ -36,75 +43,76 @@ template <class V, class K = typename V::Key> struct Dict
         Node *node = root;
         while (node) {
             log(dict_find,
-                "find(%#lx): node %p (%#lx) right %p max %p (%#lx)\n",
-                key, node, node->key, node->right, max, max ? max->key : 0);
-            if (node->key <= key && (!max || node->key > max->key)) {
+                "find(%#lx): node %p (%#lx) left %p right %p max %p (%#lx)\n",
+                key, node, node->key, node->left, node->right,
+                max, max ? max->key : 0);
+            if (node->key <= key) {
                 max = node;
+                node = node->right;
+            } else {
+                node = node->left;
             }
-            node = node->right;
         }
         return max ? max->item() : NULL;
     }
 
     V* find_exact(K key) const {
-        Node *node = root;
-        while (node) {
-            if (node->key == key) {
-                return node->item();
-            }
-            node = node->right;
-        }
-        return NULL;
+        Node *node = find_node(key);
+        return node ? node->item() : NULL;
     }
 
     bool contains(V* item) const {
-        Node *node = root;
-        while (node) {
-            if (node == node_from_item(item)) {
-                return true;
-            }
-            node = node->right;
+        Node *node = node_from_item(item);
+        while (node->parent) {
+            node = node->parent;
         }
-        return false;
+        return node == root;
     }
 
     V *insert(V* item) {
         Node *node = node_from_item(item);
         log(dict_insert, "insert(%p): key %#lx root %p (%#lx)\n",
             item, node->key, root, root ? root->key : 0);
-        node->right = root;
-        root = node;
+        Node *parent = nullptr;
+        Node **p = &root;
+        while (*p) {
+            parent = *p;
+            p = node->key < parent->key ? &parent->left : &parent->right;
+        }
+        *p = node;
+        node->parent = parent;
+        node->left = node->right = nullptr;
+        node->height = 1;
+        rebalance_up(parent);
         return item;
     }
 
     void rekey(V* item, K key) {
-        // This dictionary is still very stupid, so no need to update a sort
-        // tree or anything.
-        node_from_item(item)->key = key;
+        Node *node = node_from_item(item);
+        remove_node(node);
+        node->key = key;
+        insert(item);
     }
 
     WARN_UNUSED_RESULT V* remove(V* item) {
-        if (Node *n = remove(node_from_item(item)->key)) {
-            return n->item();
-        } else {
-            return NULL;
-        }
+        assert(contains(item));
+        remove_node(node_from_item(item));
+        return item;
     }
     WARN_UNUSED_RESULT V *remove(K key) {
-        Node **p = &root;
-        while (Node *node = *p) {
-            if (node->key == key) {
-                *p = node->right;
-                return node->item();
-            }
-            p = &node->right;
+        if (Node *node = find_node(key)) {
+            remove_node(node);
+            return node->item();
         }
         return NULL;
     }
+    // Remove and return the item with the smallest key.
     WARN_UNUSED_RESULT V *pop() {
-        Node **p = &root;
-        if (Node *node = *p) {
-            *p = node->right;
+        if (Node *node = root) {
+            while (node->left) {
+                node = node->left;
+            }
+            remove_node(node);
             return node->item();
         }
         return NULL;
@@ -113,18 +121,132 @@ template <class V, class K = typename V::Key> struct Dict
     // Find and remove one item with start < key < end and return it to the
     // caller (which takes over ownership).
     WARN_UNUSED_RESULT V *remove_range_exclusive(K start, K end) {
-        Node **p = &root;
-        while (Node *node = *p) {
-            if (start < node->key && node->key < end) {
-                *p = node->right;
-                return node->item();
+        // Find the smallest key > start.
+        Node *min = NULL;
+        Node *node = root;
+        while (node) {
+            if (start < node->key) {
+                min = node;
+                node = node->left;
+            } else {
+                node = node->right;
             }
-            p = &node->right;
+        }
+        if (min && min->key < end) {
+            remove_node(min);
+            return min->item();
         }
         return NULL;
     }
+
+private:
+    Node *find_node(K key) const {
+        Node *node = root;
+        while (node && node->key != key) {
+            node = key < node->key ? node->left : node->right;
+        }
+        return node;
+    }
+
+    static u8 height(const Node *node) {
+        return node ? node->height : 0;
+    }
+    static void update_height(Node *node) {
+        const u8 l = height(node->left), r = height(node->right);
+        node->height = 1 + (l > r ? l : r);
+    }
+
+    void replace_child(Node *parent, Node *old, Node *node) {
+        if (!parent) {
+            root = node;
+        } else if (parent->left == old) {
+            parent->left = node;
+        } else {
+            parent->right = node;
+        }
+    }
+
+    // Rotate node's right child up into node's position, return the new
+    // subtree root.
+    Node *rotate_left(Node *node) {
+        Node *r = node->right;
+        node->right = r->left;
+        if (r->left) r->left->parent = node;
+        r->parent = node->parent;
+        replace_child(node->parent, node, r);
+        r->left = node;
+        node->parent = r;
+        update_height(node);
+        update_height(r);
+        return r;
+    }
+    Node *rotate_right(Node *node) {
+        Node *l = node->left;
+        node->left = l->right;
+        if (l->right) l->right->parent = node;
+        l->parent = node->parent;
+        replace_child(node->parent, node, l);
+        l->right = node;
+        node->parent = l;
+        update_height(node);
+        update_height(l);
+        return l;
+    }
+
+    Node *rebalance(Node *node) {
+        const int balance = height(node->left) - height(node->right);
+        if (balance > 1) {
+            if (height(node->left->left) < height(node->left->right)) {
+                rotate_left(node->left);
+            }
+            return rotate_right(node);
+        } else if (balance < -1) {
+            if (height(node->right->right) < height(node->right->left)) {
+                rotate_right(node->right);
+            }
+            return rotate_left(node);
+        }
+        update_height(node);
+        return node;
+    }
+    void rebalance_up(Node *node) {
+        while (node) {
+            node = rebalance(node)->parent;
+        }
+    }
+
+    void remove_node(Node *node) {
+        Node *fixup;
+        if (node->left && node->right) {
+            // Put the successor (which has no left child) in node's place.
+            Node *succ = node->right;
+            while (succ->left) {
+                succ = succ->left;
+            }
+            if (succ->parent == node) {
+                fixup = succ;
+            } else {
+                fixup = succ->parent;
+                fixup->left = succ->right;
+                if (succ->right) succ->right->parent = fixup;
+                succ->right = node->right;
+                node->right->parent = succ;
+            }
+            succ->left = node->left;
+            node->left->parent = succ;
+            succ->parent = node->parent;
+            replace_child(node->parent, node, succ);
+        } else {
+            Node *child = node->left ? node->left : node->right;
+            if (child) child->parent = node->parent;
+            replace_child(node->parent, node, child);
+            fixup = node->parent;
+        }
+        rebalance_up(fixup);
+        node->left = node->right = node->parent = nullptr;
+        node->height = 0;
+    }
 };
 
 #define DICT_NODE(Class, member) \
     DictNode<Class::Key, Class> *node_from_item(Class *c) { return &c->member; }
-
@@ -6,20 +6,42 @@ enum HandleType {
     THREAD_HANDLE = 2,
 };
 
-struct Handle
+// Links a handle into its otherspace's list of handles that point at it,
+// see AddressSpace::targeted. A base class since a Handle's own node is used
+// for AddressSpace::sending.
+struct HandleTarget
+{
+    DListNode<HandleTarget> target_node;
+};
+DLIST_NODE(HandleTarget, target_node);
+
+struct Handle: HandleTarget
 {
     typedef uintptr_t Key;
-    DictNode<Key, Handle> node;
+    Key key_;
+    // Null if the address space is gone, then the handle can only be renamed
+    // or deleted. Only set through set_otherspace.
     AddressSpace *otherspace;
     Handle *other;
     u64 events;
     u8 type;
 
-    // Assume 0-init!
-    Handle(uintptr_t key, AddressSpace *otherspace):
-        node(key), otherspace(otherspace) {}
+    // On the owning address space's list of handles with senders.
+    DListNode<Handle> node;
+    // Processes in otherspace blocked sending to us through our peer.
+    DList<Process> senders;
+    // Processes in our address space blocked receiving from this handle.
+    DList<Process> receivers;
 
-    uintptr_t key() const { return node.key; }
+    // Assume 0-init! Only the key is set, see AddressSpace::new_handle.
+    Handle(uintptr_t key): key_(key) {}
+
+    // Also moves the handle to p's list of handles pointing at it.
+    void set_otherspace(AddressSpace *p);
+
+    uintptr_t key() const { return key_; }
+    // Only for HandleTable, the handle must not be in a table.
+    void set_key(uintptr_t key) { key_ = key; }
 
     void dissociate() {
         if (other) {
@@ -29,16 +51,16 @@ struct Handle
     }
 
     void associate(AddressSpace *p, Handle *g) {
-        g->otherspace = p;
+        g->set_otherspace(p);
         g->other = this;
         other = g;
     }
 
     static void associate(AddressSpace *p, AddressSpace *q, Handle *h, Handle *g) {
-        h->otherspace = q;
+        h->set_otherspace(q);
         h->other = g;
 
-        g->otherspace = p;
+        g->set_otherspace(p);
         g->other = h;
     }
 };
@@ -0,0 +1,174 @@
+namespace {
+
+// Handle lookup by key for an address space. Handles are looked up on every
+// IPC operation, so this needs to be O(1) for both of the common patterns:
+// small integer keys (the ones processes start with), and sparse keys that
+// servers pick themselves by renaming handles to e.g. pointers to their own
+// per-client state.
+//
+// Small keys index directly into an array of one page, allocated on first
+// use. Everything else goes into an open-addressed hash table with linear
+// probing, which is kept at most 3/4 full.
+class HandleTable {
+    static const uintptr_t SMALL_KEYS = 4096 / sizeof(Handle *);
+    static const size_t MIN_CAPACITY = 16;
+
+    Handle **small;
+    Handle **slots;
+    // Number of slots, always a power of two (or 0).
+    size_t capacity;
+    // Handles in the hash table (not counting the small array).
+    size_t used;
+
+    static Handle **alloc_slots(size_t n) {
+        const size_t bytes = n * sizeof(Handle *);
+        if (bytes <= 4096) {
+            return new Handle *[n]();
+        }
+        uintptr_t paddr = mem::allocate_contig(bytes >> 12, 0);
+        assert(paddr);
+        return PhysAddr<Handle *>(paddr);
+    }
+    static void free_slots(Handle **p, size_t n) {
+        const size_t bytes = n * sizeof(Handle *);
+        if (bytes <= 4096) {
+            delete[] p;
+        } else {
+            mem::free_contig(ToPhysAddr(p), bytes >> 12);
+        }
+    }
+
+    size_t hash(uintptr_t key) const {
+        // Fibonacci hashing: take the top bits of key * 2^64/phi. Pointers
+        // have lots of zero low bits, so don't just mask them.
+        const int bits = __builtin_ctzl(capacity);
+        return (key * 0x9e3779b97f4a7c15) >> (64 - bits);
+    }
+
+    size_t find_slot(uintptr_t key) const {
+        size_t i = hash(key);
+        while (slots[i] && slots[i]->key() != key) {
+            i = (i + 1) & (capacity - 1);
+        }
+        return i;
+    }
+
+    void grow() {
+        Handle **old = slots;
+        const size_t old_capacity = capacity;
+        capacity = capacity ? capacity * 2 : MIN_CAPACITY;
+        slots = alloc_slots(capacity);
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (Handle *h = old[i]) {
+                slots[find_slot(h->key())] = h;
+            }
+        }
+        if (old) {
+            free_slots(old, old_capacity);
+        }
+    }
+
+    void hash_insert(Handle *h) {
+        if ((used + 1) * 4 > capacity * 3) {
+            grow();
+        }
+        const size_t i = find_slot(h->key());
+        assert(!slots[i]);
+        slots[i] = h;
+        used++;
+    }
+
+    void hash_remove(size_t i) {
+        slots[i] = nullptr;
+        used--;
+        // Shift back any following entries that would no longer be found
+        // after the gap we just made.
+        size_t j = i;
+        for (;;) {
+            j = (j + 1) & (capacity - 1);
+            Handle *h = slots[j];
+            if (!h) {
+                break;
+            }
+            const size_t home = hash(h->key());
+            // Move h into the gap unless its home slot is cyclically in
+            // (i, j], in which case it's still reachable.
+            if (((j - home) & (capacity - 1)) >= ((j - i) & (capacity - 1))) {
+                slots[i] = h;
+                slots[j] = nullptr;
+                i = j;
+            }
+        }
+    }
+
+public:
+    HandleTable(): small(nullptr), slots(nullptr), capacity(0), used(0) {}
+    HandleTable(const HandleTable&) = delete;
+    HandleTable& operator=(const HandleTable&) = delete;
+    ~HandleTable() {
+        assert(!used);
+        if (small) mem::free(small);
+        if (slots) free_slots(slots, capacity);
+    }
+
+    Handle *find(uintptr_t key) const {
+        if (key < SMALL_KEYS) {
+            return small ? small[key] : nullptr;
+        }
+        if (!used) {
+            return nullptr;
+        }
+        return slots[find_slot(key)];
+    }
+
+    Handle *insert(Handle *h) {
+        const uintptr_t key = h->key();
+        if (key < SMALL_KEYS) {
+            if (!small) {
+                small = (Handle **)mem::malloc(4096);
+            }
+            assert(!small[key]);
+            small[key] = h;
+        } else {
+            hash_insert(h);
+        }
+        return h;
+    }
+
+    // Returns the handle removed, or null if there was no handle with that
+    // key.
+    Handle *remove(uintptr_t key) {
+        if (key < SMALL_KEYS) {
+            return small ? latch(small[key]) : nullptr;
+        }
+        if (!used) {
+            return nullptr;
+        }
+        const size_t i = find_slot(key);
+        Handle *res = slots[i];
+        if (res) {
+            hash_remove(i);
+        }
+        return res;
+    }
+
+    // Remove and return any one handle, or null when empty.
+    Handle *pop() {
+        if (small) {
+            for (uintptr_t key = 0; key < SMALL_KEYS; key++) {
+                if (small[key]) {
+                    return latch(small[key]);
+                }
+            }
+        }
+        for (size_t i = 0; used && i < capacity; i++) {
+            if (Handle *h = slots[i]) {
+                hash_remove(i);
+                return h;
+            }
+        }
+        return nullptr;
+    }
+};
+
+}
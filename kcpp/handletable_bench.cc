@@ -0,0 +1,77 @@
+// Host benchmark for HandleTable lookups, compared to looking up the same keys
+// in a Dict.
+
+#include "host.h"
+#include "dict.h"
+#include "dlist.h"
+#include "handle.h"
+#include "handletable.h"
+
+namespace {
+
+struct DictEntry {
+    typedef uintptr_t Key;
+    DictNode<Key, DictEntry> node;
+
+    DictEntry(uintptr_t key): node(key) {}
+};
+DICT_NODE(DictEntry, node);
+
+const size_t LOOKUPS = 1 << 22;
+
+// Sparse keys look like heap pointers, as used by servers that rename client
+// handles to their per-client state.
+uintptr_t sparse_key(size_t i) {
+    return 0x7f0000000000 + (i * 0x9c40 & 0xfffffff0) + i * 16;
+}
+
+template <typename Lookup>
+double time_lookups(const uintptr_t *keys, size_t n, Lookup lookup) {
+    uintptr_t sum = 0;
+    const u64 start = host_nsec();
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        sum += (uintptr_t)lookup(keys[(i * 7919) % n]);
+    }
+    const u64 end = host_nsec();
+    // Don't let the compiler throw away the lookups.
+    if (!sum) abort();
+    return double(end - start) / LOOKUPS;
+}
+
+void bench(size_t n, bool sparse) {
+    uintptr_t *keys = new uintptr_t[n];
+    HandleTable table;
+    Dict<DictEntry> dict;
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = sparse ? sparse_key(i) : i + 1;
+        table.insert(new Handle(keys[i]));
+        dict.insert(new DictEntry(keys[i]));
+    }
+    for (size_t i = 0; i < n; i++) {
+        assert(table.find(keys[i])->key() == keys[i]);
+    }
+
+    const double t = time_lookups(keys, n,
+            [&](uintptr_t key) { return table.find(key); });
+    const double d = time_lookups(keys, n,
+            [&](uintptr_t key) { return dict.find_exact(key); });
+    printf("%6zu %-6s keys: HandleTable %5.1f ns  Dict %5.1f ns\n",
+            n, sparse ? "sparse" : "small", t, d);
+
+    while (Handle *h = table.pop()) {
+        delete h;
+    }
+    while (DictEntry *e = dict.pop()) {
+        delete e;
+    }
+    delete[] keys;
+}
+
+}
+
+int main() {
+    for (size_t n = 4; n <= 16384; n *= 4) {
+        bench(n, false);
+        bench(n, true);
+    }
+}
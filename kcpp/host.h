@@ -0,0 +1,130 @@
+// Stand-ins for the parts of main.cc that kernel headers depend on, for
+// building them into host programs like tests and benchmarks.
+//
+// By default mem:: allocations just come from the host heap. Define
+// HOST_KERNEL_MEM to use the real mem.h instead, with "physical memory" in an
+// arena at host_phys_base.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+typedef int64_t i64;
+typedef int32_t i32;
+typedef int16_t i16;
+typedef int8_t i8;
+typedef uint64_t u64;
+typedef uint32_t u32;
+typedef uint16_t u16;
+typedef uint8_t u8;
+
+#define PACKED __attribute__((packed))
+#define UNUSED __attribute__((unused))
+#define NORETURN __attribute__((noreturn))
+#define WARN_UNUSED_RESULT __attribute__((warn_unused_result))
+
+#define log(scope, fmt, ...) do {} while (0)
+
+template <typename T>
+T latch(T& var, T value = T()) {
+    T res = var;
+    var = value;
+    return res;
+}
+
+static const intptr_t kernel_base = -(1 << 30);
+static const intptr_t direct_map_base = -((intptr_t)1 << 47);
+
+static u8 *host_phys_base;
+
+template <class T>
+static T* PhysAddr(uintptr_t phys) {
+    return (T*)(host_phys_base + phys);
+}
+static inline uintptr_t ToPhysAddr(const volatile void *p) {
+    return (const volatile u8 *)p - host_phys_base;
+}
+
+namespace x86 {
+    struct CPUID {
+        u32 eax, ebx, ecx, edx;
+    };
+    // No features, e.g. no 1GiB pages.
+    static inline CPUID cpuid(u32 leaf) {
+        return CPUID {};
+    }
+    // The "page tables" are in the first page of the arena.
+    static inline u64 cr3() {
+        return 0;
+    }
+
+    enum rflags : u64 {
+        IF = 1 << 9,
+    };
+    struct Regs {
+        u64 rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi;
+        u64 r8, r9, r10, r11, r12, r13, r14, r15;
+    };
+    struct SavedRegs {
+        Regs regs;
+        u64 rip;
+        u64 rflags;
+        u64 cr3;
+
+        void dump() const {}
+    };
+}
+
+namespace start32 {
+    // Stands in for the kernel's half of every PML4.
+    static const uintptr_t kernel_pdp_addr = 0;
+}
+
+UNUSED NORETURN static void abort(const char *msg) {
+    fprintf(stderr, "abort: %s", msg);
+    abort();
+}
+UNUSED NORETURN static void unimpl(const char *what) {
+    fprintf(stderr, "UNIMPL: %s\n", what);
+    abort();
+}
+UNUSED static void strlcpy(char *dst, const char *src, size_t dstsize) {
+    snprintf(dst, dstsize, "%s", src);
+}
+
+namespace proc { struct Process; }
+using proc::Process;
+namespace aspace { struct AddressSpace; struct Backing; }
+using aspace::AddressSpace;
+namespace cpu { struct Cpu; }
+
+#ifndef HOST_KERNEL_MEM
+namespace mem {
+    static inline void *malloc(size_t sz) {
+        assert(sz <= 4096);
+        void *res = aligned_alloc(4096, 4096);
+        memset(res, 0, 4096);
+        return res;
+    }
+    static inline void free(void *p) {
+        ::free(p);
+    }
+    static inline uintptr_t allocate_contig(size_t pages, size_t align) {
+        void *res = aligned_alloc(align > 4096 ? align : 4096, pages << 12);
+        memset(res, 0, pages << 12);
+        return (uintptr_t)res;
+    }
+    static inline void free_contig(uintptr_t paddr, size_t pages) {
+        ::free((void *)paddr);
+    }
+}
+#endif
+
+static inline u64 host_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,136 @@
+namespace lapic {
+
+// Every CPU sees its own local APIC at the same physical address. The kernel
+// uses it for IPIs (starting APs and waking idle CPUs), user-mode drivers map
+// it too for the timer and for EOIs.
+//
+// The kernel also uses the timer for preemption, until a user-mode driver
+// (cuser/apic.c) takes it over by reprogramming it.
+static const uintptr_t PBASE = 0xfee00000;
+
+enum Reg {
+    ID = 0x20,
+    TPR = 0x80,
+    EOI = 0xb0,
+    SPURIOUS = 0xf0,
+    ICR_LOW = 0x300,
+    ICR_HIGH = 0x310,
+    TIMER = 0x320,
+    TIMER_INITIAL = 0x380,
+    TIMER_CURRENT = 0x390,
+    TIMER_DIVIDE = 0x3e0,
+};
+
+enum : u32 {
+    SOFTWARE_ENABLE = 0x100,
+
+    ICR_FIXED = 0x000,
+    ICR_INIT = 0x500,
+    ICR_STARTUP = 0x600,
+    ICR_PENDING = 0x1000,
+    ICR_ASSERT = 0x4000,
+    ICR_ALL_BUT_SELF = 0xc0000,
+
+    TIMER_MASKED = 0x10000,
+    TIMER_PERIODIC = 0x20000,
+    TIMER_DIVIDE_16 = 0x3,
+};
+
+// Vectors used by the kernel itself, above anything handed out to drivers.
+static const u8 WAKE_VECTOR = 0xf0;
+static const u8 TIMER_VECTOR = 0xf1;
+static const u8 SPURIOUS_VECTOR = 0xff;
+
+volatile u32 &reg(Reg r) {
+    return *PhysAddr<volatile u32>(PBASE + r);
+}
+
+u8 id() {
+    return reg(ID) >> 24;
+}
+
+void eoi() {
+    reg(EOI) = 0;
+}
+
+void wait_icr() {
+    while (reg(ICR_LOW) & ICR_PENDING) {
+        asm volatile("pause" ::: "memory");
+    }
+}
+
+void send_ipi(u8 dest, u32 cmd) {
+    wait_icr();
+    reg(ICR_HIGH) = (u32)dest << 24;
+    reg(ICR_LOW) = cmd;
+}
+
+void broadcast_ipi(u32 cmd) {
+    wait_icr();
+    reg(ICR_LOW) = cmd | ICR_ALL_BUT_SELF;
+}
+
+// Busy-wait using PIT channel 2, which is otherwise unused (it drives the PC
+// speaker). Only used while booting, for the startup sequence and to
+// calibrate the timer.
+namespace pit {
+    static const u32 HZ = 1193182;
+
+    void wait(u16 count) {
+        // Gate on and speaker off, then one-shot (mode 0): the output goes
+        // high when the count reaches zero.
+        x86::outb(0x61, (x86::inb(0x61) & ~0x02) | 0x01);
+        x86::outb(0x43, 0xb0);
+        x86::outb(0x42, count & 0xff);
+        x86::outb(0x42, count >> 8);
+        while (!(x86::inb(0x61) & 0x20)) {
+            asm volatile("pause" ::: "memory");
+        }
+    }
+}
+
+void delay_us(u32 us) {
+    while (us) {
+        const u32 n = us < 50000 ? us : 50000;
+        pit::wait(n * (u64)pit::HZ / 1000000);
+        us -= n;
+    }
+}
+
+// Length of a scheduler tick.
+static const u32 TICK_US = 5000;
+// Timer counts per tick, same for all CPUs.
+static u32 timer_ticks;
+
+// Measure the timer frequency against the PIT. Done once on the boot CPU.
+void calibrate_timer() {
+    static const u32 SAMPLE_US = 10000;
+    reg(TIMER_DIVIDE) = TIMER_DIVIDE_16;
+    reg(TIMER) = TIMER_MASKED | TIMER_VECTOR;
+    reg(TIMER_INITIAL) = 0xffffffff;
+    delay_us(SAMPLE_US);
+    const u32 elapsed = 0xffffffff - reg(TIMER_CURRENT);
+    reg(TIMER_INITIAL) = 0;
+    timer_ticks = (u64)elapsed * TICK_US / SAMPLE_US;
+    printf("lapic: %u timer counts per %uus tick\n", timer_ticks, TICK_US);
+}
+
+// Start the periodic scheduler tick on this CPU.
+void start_timer() {
+    reg(TIMER_DIVIDE) = TIMER_DIVIDE_16;
+    reg(TIMER) = TIMER_PERIODIC | TIMER_VECTOR;
+    reg(TIMER_INITIAL) = timer_ticks;
+}
+
+// Map the registers, once, before any CPU is started.
+void map() {
+    mem::direct_map_mmio(PBASE);
+}
+
+// Software-enable this CPU's local APIC, which is needed to receive IPIs.
+void init() {
+    reg(SPURIOUS) = reg(SPURIOUS) | SOFTWARE_ENABLE | SPURIOUS_VECTOR;
+    reg(TPR) = 0;
+}
+
+}
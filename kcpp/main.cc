@@ -77,6 +77,13 @@ void strlcpy(char *dst, const char *src, size_t dstsize) {
 #define log_grant 0
 #define log_waiters 0
 #define log_pulse 0
+#define log_msgbuf 0
+#define log_string 0
+#define log_batch 0
+#define log_slab 0
+#define log_aspace 0
+#define log_smp 0
+#define log_steal 0
 
 #define log(scope, fmt, ...) do { \
     if (log_ ## scope) { \
@@ -88,10 +95,10 @@ void strlcpy(char *dst, const char *src, size_t dstsize) {
     } \
 } while (0)
 
-namespace { namespace mem { void *malloc(size_t); void free(void *); } }
+namespace { namespace slab { void *malloc(size_t); void free(void *); } }
 
-using mem::malloc;
-using mem::free;
+using slab::malloc;
+using slab::free;
 
 void *operator new(size_t sz) {
     return malloc(sz);
@@ -156,17 +163,23 @@ long int strtol(const char *p, char **end, int radix) {
     unimpl("strtol");
 }
 static const intptr_t kernel_base = -(1 << 30);
+// All of physical memory is mapped starting at the bottom of the kernel half,
+// see mem::init. The first GiB is also mapped at kernel_base, and that's the
+// only mapping that exists before the direct map has been set up.
+static const intptr_t direct_map_base = -((intptr_t)1 << 47);
 
 template <class T>
 static constexpr T* PhysAddr(uintptr_t phys) {
-    return (T*)(phys + kernel_base);
+    return (T*)(phys < (uintptr_t)-kernel_base
+            ? phys + kernel_base : phys + direct_map_base);
 }
 template <class T>
 static constexpr T* HighAddr(T* lowptr) {
     return PhysAddr<T>((uintptr_t)lowptr);
 }
 uintptr_t ToPhysAddr(const volatile void *p) {
-    return (uintptr_t)p - kernel_base;
+    const intptr_t addr = (intptr_t)p;
+    return addr >= kernel_base ? addr - kernel_base : addr - direct_map_base;
 }
 
 static void memset16(u16* dest, u16 value, size_t n) {
@@ -303,6 +316,37 @@ namespace x86 {
     void ltr(seg tr) {
         asm("ltr %0" ::"r"(tr));
     }
+
+    struct TSS {
+        u32 reserved0;
+        u64 rsp0, rsp1, rsp2;
+        u64 reserved1;
+        u64 ist[7];
+        u64 reserved2;
+        u16 reserved3;
+        u16 iopb;
+    } __attribute__((packed));
+
+    // Write the two-entry 64-bit TSS descriptor at desc.
+    void set_tss_descriptor(u64 *desc, const TSS *tss) {
+        const u64 base = (u64)tss;
+        const u64 limit = sizeof(TSS) - 1;
+        const u64 type = 0x89; // Present, available 64-bit TSS
+        desc[0] = limit | (base & 0xffffff) << 16 | type << 40
+            | (base >> 24 & 0xff) << 56;
+        desc[1] = base >> 32;
+    }
+
+    u64 cr0() {
+        u64 cr0;
+        asm volatile("movq %%cr0, %0" : "=r"(cr0));
+        return cr0;
+    }
+    u64 cr4() {
+        u64 cr4;
+        asm volatile("movq %%cr4, %0" : "=r"(cr4));
+        return cr4;
+    }
     u64 cr3() {
         u64 cr3;
         asm volatile("movq %%cr3, %0" : "=r"(cr3));
@@ -313,6 +357,29 @@ namespace x86 {
             asm volatile("movq %0, %%cr3" :: "r"(new_cr3));
         }
     }
+    void flush_tlb() {
+        asm volatile("movq %0, %%cr3" :: "r"(cr3()) : "memory");
+    }
+
+    u8 inb(u16 port) {
+        u8 res;
+        asm volatile("inb %1, %0" : "=a"(res) : "Nd"(port));
+        return res;
+    }
+    void outb(u16 port, u8 data) {
+        asm volatile("outb %0, %1" :: "a"(data), "Nd"(port));
+    }
+
+    struct CPUID {
+        u32 eax, ebx, ecx, edx;
+    };
+    CPUID cpuid(u32 leaf) {
+        CPUID res;
+        asm("cpuid"
+            : "=a"(res.eax), "=b"(res.ebx), "=c"(res.ecx), "=d"(res.edx)
+            : "a"(leaf), "c"(0));
+        return res;
+    }
 
     u64 cr2() {
         u64 cr2;
@@ -320,6 +387,12 @@ namespace x86 {
         return cr2;
     }
 
+    u64 rdtsc() {
+        u32 lo, hi;
+        asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+        return (u64)hi << 32 | lo;
+    }
+
     u64 get_cpu_specific() {
         u64 res = 0;
         asm("gs movq (%0), %0": "=r"(res) : "0"(res));
@@ -427,8 +500,10 @@ namespace idt {
         return end;
     }
 
+    // Shared by all CPUs.
+    static Table idt_table;
+
     void init() {
-        static Table idt_table;
         static u8 idt_code[IRQ_STUB_SIZE * N_IRQ_STUBS];
         idt_table[7] = handler_NM_stub;
         idt_table[8] = handler_DF_stub;
@@ -479,16 +554,21 @@ void dumpMBInfo(const mboot::Info& info) {
 
 namespace proc { struct Process; }
 using proc::Process;
-namespace aspace { struct AddressSpace; }
+namespace aspace { struct AddressSpace; struct Backing; }
 using aspace::AddressSpace;
+namespace cpu { struct Cpu; }
 
+#include "spinlock.h"
 #include "dict.h"
 #include "dlist.h"
 #include "mem.h"
+#include "slab.h"
 #include "refcnt.h"
 #include "handle.h"
+#include "handletable.h"
 #include "aspace.h"
 #include "proc.h"
+#include "lapic.h"
 #include "cpu.h"
 using cpu::Cpu;
 using cpu::getcpu;
@@ -516,7 +596,7 @@ void assoc_procs(Process *p, uintptr_t i, Process *q, uintptr_t j) {
     p->assoc_handles(j, q, i);
 }
 
-void init_modules(Cpu *cpu, const mboot::Info& info) {
+void init_modules(const mboot::Info& info) {
     assert(info.has(mboot::Modules));
     auto mod = PhysAddr<mboot::Module>(info.mods_addr);
     const size_t count = info.mods_count;
@@ -530,15 +610,16 @@ void init_modules(Cpu *cpu, const mboot::Info& info) {
         mod++;
     }
     if (count) {
-        cpu->irq_process = procs[0];
+        cpu::irq_process = procs[0];
     }
     for (size_t i = 0; i < count; i++) {
         for (size_t j = i + 1; j < count; j++) {
             assoc_procs(procs[i], i + 1, procs[j], j + 1);
         }
     }
+    // Spread the processes over all CPUs to start with.
     for (size_t i = 0; i < count; i++) {
-        cpu->queue(procs[i]);
+        cpu::cpus[i % cpu::n_cpus]->queue(procs[i]);
     }
     delete[] procs;
 }
@@ -573,23 +654,23 @@ NORETURN void page_fault(Process *p, u64 error) {
     getcpu().switch_to(p);
 }
 
-void handle_irq_generic(Cpu *cpu, u8 vec) {
-    auto p = cpu->irq_process;
+void handle_irq_generic(u8 vec) {
+    auto p = cpu::irq_process;
     assert(p);
     log(irq, "IRQ %d triggered, irq process is %s\n", vec, p->name());
 
     vec -= 32;
     u8 ix = vec >> 6;
     u64 mask = 1 << (vec & 63);
-    if (cpu->irq_delayed[ix] & mask) {
+    if (cpu::irq_delayed[ix] & mask) {
         // Already delayed, so we can't do anything else here
         log(irq, "handle_irq_generic: already delayed\n");
         return;
     }
-    cpu->irq_delayed[ix] |= mask;
+    cpu::irq_delayed[ix] |= mask;
 
     if (auto rcpt = p->aspace->pop_open_recipient()) {
-        auto irqs = latch(cpu->irq_delayed[0]);
+        auto irqs = latch(cpu::irq_delayed[0]);
         log(irq, "handle_irq_generic: sending %lx to %s\n", irqs, rcpt->name());
         syscall::transfer_pulse(rcpt, 0, irqs);
     }
@@ -611,6 +692,7 @@ void int_entry(u8 vec, u64 err, Cpu *cpu) {
         cpu->dump_regs();
         abort();
     }
+    cpu::kernel_lock.lock();
     auto p = cpu->process;
     if (p) {
         if (log_int_entry_regs) {
@@ -620,6 +702,7 @@ void int_entry(u8 vec, u64 err, Cpu *cpu) {
         cpu->leave(p);
     } else {
         log(idle, "Got interrupt %u while idle\n", vec);
+        cpu->leave_idle();
     }
     // TODO Add symbolic constants for all defined exceptions
     switch (vec) {
@@ -627,12 +710,25 @@ void int_entry(u8 vec, u64 err, Cpu *cpu) {
         assert(p);
         page_fault(p, err);
         break;
+    case lapic::TIMER_VECTOR:
+        lapic::eoi();
+        cpu->tick(p);
+        break;
+    case lapic::WAKE_VECTOR:
+        // Some other CPU queued something for us, just check the runqueue.
+        lapic::eoi();
+        [[fallthrough]];
+    case lapic::SPURIOUS_VECTOR:
+        if (p) {
+            cpu->queue(p);
+        }
+        cpu->run();
     default:
         if (vec >= 32) {
             if (p) {
                 cpu->queue(p);
             }
-            handle_irq_generic(cpu, vec);
+            handle_irq_generic(vec);
             cpu->run();
         } else {
             printf("Unimplemented CPU Exception #%d\n", vec);
@@ -649,22 +745,106 @@ extern "C" Ctor __CTOR_END__[];
 void run_constructors(Ctor *p, Ctor *end) {
     while (p != end) (*p++)();
 }
+
+// Application processor startup code from trampoline.asm.
+namespace trampoline {
+    extern "C" const u8 ap_trampoline[];
+    extern "C" const u8 ap_trampoline_args[];
+    extern "C" const u8 ap_trampoline_end[];
+
+    // Must match AP_TRAMPOLINE in trampoline.asm.
+    static const uintptr_t ADDR = 0x8000;
+
+    // Must match struc args in trampoline.asm.
+    struct Args {
+        u32 lock;
+        u32 cr0;
+        u32 cr3;
+        u32 cr4;
+        u64 stack;
+        u64 entry;
+    };
+
+    Args *args() {
+        return PhysAddr<Args>(ADDR + (ap_trampoline_args - ap_trampoline));
+    }
+}
+
+extern "C" void start64_ap() NORETURN;
+
+// Start all other CPUs with INIT-SIPI-SIPI. They run start64_ap and then go
+// idle until they get something to run.
+void start_aps() {
+    using namespace trampoline;
+    memcpy(PhysAddr<u8>(ADDR), ap_trampoline, ap_trampoline_end - ap_trampoline);
+    Args *a = args();
+    a->cr0 = x86::cr0();
+    a->cr3 = x86::cr3();
+    a->cr4 = x86::cr4();
+    // Shared by the APs while starting, see trampoline.asm. Never freed
+    // since we don't know when the last AP is done with it.
+    a->stack = (u64)new u8[Cpu::STACK_SIZE] + Cpu::STACK_SIZE;
+    a->entry = (u64)start64_ap;
+
+    lapic::broadcast_ipi(lapic::ICR_INIT | lapic::ICR_ASSERT);
+    lapic::delay_us(10000);
+    for (int i = 0; i < 2; i++) {
+        lapic::broadcast_ipi(lapic::ICR_STARTUP | (ADDR >> 12));
+        lapic::delay_us(200);
+    }
+    // Wait until no more CPUs show up, so init_modules can use them all.
+    size_t n;
+    do {
+        n = __atomic_load_n(&cpu::n_cpus, __ATOMIC_ACQUIRE);
+        lapic::delay_us(10000);
+    } while (n != __atomic_load_n(&cpu::n_cpus, __ATOMIC_ACQUIRE));
+    printf("%zu CPU(s) started\n", n);
+}
+
+NORETURN void ap_run(Cpu *cpu) {
+    // Now off the shared boot stack, let the next AP have it.
+    __atomic_store_n(&trampoline::args()->lock, 0, __ATOMIC_RELEASE);
+    cpu->run();
+}
 }
 
 void start64() {
+    cpu::early_init();
     run_constructors(__CTOR_LIST__, __CTOR_END__);
     dumpMBInfo(start32::mboot_info());
 
     x86::lgdt(start32::gdtr);
-    x86::ltr(x86::seg::tss64);
     idt::init();
 
-    mem::init(start32::mboot_info(), start32::memory_start, -kernel_base);
-//  write("Memory initialized. ");
-//  mem::stat();
+    mem::init(start32::mboot_info(), start32::memory_start);
+    lapic::map();
+    lapic::calibrate_timer();
 
     auto cpu = new Cpu();
     cpu->start();
-    init_modules(cpu, start32::mboot_info());
+    start_aps();
+
+    cpu::kernel_lock.lock();
+    init_modules(start32::mboot_info());
+    mem::stat();
+    slab::stat();
+    cpu::stat();
     cpu->run();
 }
+
+void start64_ap() {
+    cpu::early_init();
+    idt::load(idt::idt_table);
+
+    cpu::kernel_lock.lock();
+    if (cpu::n_cpus == mem::MAX_CPUS) {
+        printf("Too many CPUs, APIC ID %u not started\n", lapic::id());
+        __atomic_store_n(&trampoline::args()->lock, 0, __ATOMIC_RELEASE);
+        cpu::kernel_lock.unlock();
+        for (;;) asm volatile("cli; hlt");
+    }
+    auto cpu = new Cpu();
+    cpu->start();
+    log(smp, "CPU %u started, APIC ID %u\n", cpu->id, cpu->apic_id);
+    cpu::run_on_stack(cpu, ap_run);
+}
@@ -3,65 +3,564 @@ namespace mem {
 struct free_page {
     free_page *next;
 };
-static free_page* freelist_head;
-static u32 used_pages, total_pages;
 
 template <typename T>
 T *add_byte_offset(T *p, intptr_t offset) {
     return (T*)((char*)p + offset);
 }
 
-// TODO Implement per-cpu cache of page(s).
+// Metadata for each physical frame, indexed by page frame number.
+struct Frame {
+    enum Flags : u8 {
+        // Anonymous (or DMA) memory, freed when the last mapping of it, or
+        // other reference (see aspace::put_frame), goes away.
+        Anon = 1,
+    };
+
+    // All backings (in any address space) mapping this frame.
+    DList<aspace::Backing> mappings;
+    u32 mapcount;
+    u8 flags;
+    // For the first page of a free block in the buddy allocator: the order
+    // of the block + 1. 0 for all other pages.
+    u8 order;
+};
+static Frame *frames;
+static uintptr_t max_pfn;
+
+// Returns null for physical addresses outside RAM (e.g. device memory).
+Frame *frame(uintptr_t paddr) {
+    const uintptr_t pfn = paddr >> 12;
+    return pfn < max_pfn ? &frames[pfn] : nullptr;
+}
+
+// Global page allocator: a binary buddy allocator. Free blocks of 2^order
+// pages are kept on one list per order, and the first page of each free block
+// is marked in its Frame so that a block being freed can find out if its
+// buddy is free and merge with it.
+static const unsigned MAX_ORDER = 10;
+
+struct free_block {
+    DListNode<free_block> node;
+};
+DLIST_NODE(free_block, node);
+
+static DList<free_block> free_area[MAX_ORDER + 1];
+static u32 free_pages, total_pages;
+// Protects the buddy allocator. The per-CPU magazines (see PerCpu) are only
+// used by their own CPU and don't need locking, so this is only taken when
+// moving batches of pages to or from the global lists.
+static SpinLock global_lock;
+
+free_block *pfn_block(uintptr_t pfn) {
+    return PhysAddr<free_block>(pfn << 12);
+}
+uintptr_t block_pfn(free_block *block) {
+    return ToPhysAddr(block) >> 12;
+}
+
+void add_free_block(uintptr_t pfn, unsigned order) {
+    free_block *block = pfn_block(pfn);
+    block->node = DListNode<free_block>();
+    frames[pfn].order = order + 1;
+    free_area[order].append(block);
+}
+
+void free_block_order(uintptr_t pfn, unsigned order) {
+    assert(!(pfn & ((1 << order) - 1)));
+    free_pages += 1 << order;
+    while (order < MAX_ORDER) {
+        const uintptr_t buddy = pfn ^ (1 << order);
+        if (buddy >= max_pfn || frames[buddy].order != order + 1) {
+            break;
+        }
+        free_area[order].remove(pfn_block(buddy));
+        frames[buddy].order = 0;
+        pfn &= ~(uintptr_t)(1 << order);
+        order++;
+    }
+    add_free_block(pfn, order);
+}
+
+// Returns the frame number of the first page in the block, or 0 if there's no
+// free block big enough. (Page 0 is never handed out by the allocator.)
+uintptr_t alloc_block_order(unsigned order) {
+    unsigned o = order;
+    while (o <= MAX_ORDER && !free_area[o].head) {
+        o++;
+    }
+    if (o > MAX_ORDER) {
+        return 0;
+    }
+    const uintptr_t pfn = block_pfn(free_area[o].pop());
+    frames[pfn].order = 0;
+    // Split the block, giving back the upper half until we're at the right
+    // size.
+    while (o > order) {
+        o--;
+        add_free_block(pfn + (1 << o), o);
+    }
+    free_pages -= 1 << order;
+    return pfn;
+}
+
+// Free an arbitrary range of pages, in the biggest aligned blocks possible.
+void free_range(uintptr_t pfn, uintptr_t end) {
+    while (pfn < end) {
+        unsigned order = 0;
+        while (order < MAX_ORDER
+                && !(pfn & ((2 << order) - 1))
+                && pfn + (2 << order) <= end) {
+            order++;
+        }
+        free_block_order(pfn, order);
+        pfn += 1 << order;
+    }
+}
+
+// Take up to n single pages from the global allocator, return the number of
+// pages actually taken. The pages are linked through free_page::next, with
+// *last pointing to the last page taken.
+u32 take_global(free_page **first, free_page **last, u32 n) {
+    SpinLockGuard guard(global_lock);
+    *first = *last = nullptr;
+    u32 i = 0;
+    while (i < n) {
+        uintptr_t pfn = alloc_block_order(0);
+        if (!pfn) {
+            break;
+        }
+        free_page *page = PhysAddr<free_page>(pfn << 12);
+        page->next = *first;
+        *first = page;
+        if (!*last) {
+            *last = page;
+        }
+        i++;
+    }
+    return i;
+}
+
+// Give n pages linked through free_page::next back to the global allocator.
+void put_global(free_page *first, u32 n) {
+    SpinLockGuard guard(global_lock);
+    free_page *p = first;
+    while (n--) {
+        free_page *next = p->next;
+        free_block_order(ToPhysAddr(p) >> 12, 0);
+        p = next;
+    }
+}
+
+u8 order_for_pages(size_t pages) {
+    u8 order = 0;
+    while ((size_t)1 << order < pages) {
+        order++;
+    }
+    return order;
+}
+
+// Allocate physically contiguous memory, e.g. for DMA. The returned physical
+// address is aligned to at least the given alignment (rounded up to a power
+// of two and a whole page). Returns 0 if no large enough block is free.
+uintptr_t allocate_contig(size_t pages, size_t align) {
+    unsigned order = order_for_pages(pages > align >> 12 ? pages : align >> 12);
+    if (!pages || order > MAX_ORDER) {
+        return 0;
+    }
+    uintptr_t pfn;
+    {
+        SpinLockGuard guard(global_lock);
+        pfn = alloc_block_order(order);
+        if (!pfn) {
+            return 0;
+        }
+        // Give back anything past the end of the requested size.
+        free_range(pfn + pages, pfn + ((uintptr_t)1 << order));
+    }
+    memset(PhysAddr<u8>(pfn << 12), 0, pages << 12);
+    return pfn << 12;
+}
+
+void free_contig(uintptr_t paddr, size_t pages) {
+    assert(!(paddr & 0xfff));
+    SpinLockGuard guard(global_lock);
+    free_range(paddr >> 12, (paddr >> 12) + pages);
+}
+
+// Zero a page with non-temporal stores, so that pre-zeroing pages doesn't
+// evict anything useful from the cache.
+void zero_page_nt(void *page) {
+    u64 *p = (u64 *)page;
+    u64 *const end = p + 512;
+    for (; p < end; p += 4) {
+        asm volatile("movnti %1, (%0)\n\t"
+                     "movnti %1, 8(%0)\n\t"
+                     "movnti %1, 16(%0)\n\t"
+                     "movnti %1, 24(%0)"
+                     :: "r"(p), "r"(0ul) : "memory");
+    }
+    asm volatile("sfence" ::: "memory");
+}
+
+// Per-CPU magazine of free pages. Allocations and frees on a CPU go to its own
+// magazine, and only when it runs empty (or full) is a batch of pages moved
+// from (or to) the global free list.
+//
+// Each CPU also keeps a separate stack of pages that are already zeroed,
+// filled from the idle loop. Allocations that need zeroed memory take from it
+// first and only fall back to zeroing a dirty page themselves.
+struct PerCpu {
+    static const u32 SIZE = 64;
+    static const u32 BATCH = SIZE / 2;
+    static const u32 ZEROED_MAX = 256;
+
+    free_page *head;
+    u32 count;
+
+    // Zeroed pages, except for the next pointer in the first word.
+    free_page *zeroed;
+    u32 zeroed_count;
+
+    // Allocations served from the magazine / allocations that found it empty.
+    u64 hits, misses;
+    // Batches moved from and to the global list.
+    u64 refills, drains;
+    // Zeroed allocations served from the zeroed pool / that had to memset.
+    u64 zero_hits, zero_misses;
+
+    void *alloc() {
+        if (!head) {
+            misses++;
+            refill();
+            if (!head) {
+                // Out of dirty pages, but there might be zeroed ones.
+                return pop_zeroed();
+            }
+        } else {
+            hits++;
+        }
+        free_page *res = head;
+        head = res->next;
+        count--;
+        return res;
+    }
+
+    void *alloc_zeroed() {
+        if (void *res = pop_zeroed()) {
+            zero_hits++;
+            return res;
+        }
+        zero_misses++;
+        void *res = alloc();
+        if (res) {
+            memset(res, 0, 4096);
+        }
+        return res;
+    }
+
+    void free(free_page *page) {
+        if (count == SIZE) {
+            drain();
+        }
+        page->next = head;
+        head = page;
+        count++;
+    }
+
+    void *pop_zeroed() {
+        free_page *res = zeroed;
+        if (res) {
+            zeroed = res->next;
+            zeroed_count--;
+            res->next = nullptr;
+        }
+        return res;
+    }
+
+    // Zero one dirty page and add it to the zeroed pool. Returns false if
+    // there was nothing to do.
+    bool zero_one() {
+        if (zeroed_count >= ZEROED_MAX) {
+            return false;
+        }
+        if (!head) {
+            refill();
+            if (!head) {
+                return false;
+            }
+        }
+        free_page *page = head;
+        head = page->next;
+        count--;
+        zero_page_nt(page);
+        page->next = zeroed;
+        zeroed = page;
+        zeroed_count++;
+        return true;
+    }
+
+    void refill() {
+        free_page *first, *last;
+        u32 n = take_global(&first, &last, BATCH);
+        if (n) {
+            refills++;
+            last->next = head;
+            head = first;
+            count += n;
+        }
+    }
+
+    void drain() {
+        free_page *first = head, *last = head;
+        for (u32 i = 1; i < BATCH; i++) {
+            last = last->next;
+        }
+        head = last->next;
+        count -= BATCH;
+        put_global(first, BATCH);
+        drains++;
+    }
+
+    void stat() const {
+        printf("%u pages cached, %lu hits, %lu misses, %lu refills, %lu drains\n",
+                count, hits, misses, refills, drains);
+        printf("%u pages zeroed, %lu zeroed hits, %lu zeroed misses\n",
+                zeroed_count, zero_hits, zero_misses);
+    }
+};
+
+// Implemented in cpu.h. Returns the magazine for the current CPU, or null
+// during early boot when no CPU has been started yet.
+PerCpu *percpu();
+
+static const size_t MAX_CPUS = 16;
+static PerCpu *cpus[MAX_CPUS];
+static size_t n_cpus;
+
+void add_cpu(PerCpu *pc) {
+    assert(n_cpus < MAX_CPUS);
+    cpus[n_cpus++] = pc;
+}
+
 void free(void *page) {
     if (!page) return;
 
     free_page *free = (free_page *)page;
-    free->next = freelist_head;
-    freelist_head = free;
-    used_pages--;
+    if (PerCpu *pc = percpu()) {
+        pc->free(free);
+    } else {
+        put_global(free, 1);
+    }
+}
+
+// Allocate a page without clearing it, for users that will initialize all of
+// it themselves anyway.
+void *malloc_dirty() {
+    void *res;
+    if (PerCpu *pc = percpu()) {
+        res = pc->alloc();
+    } else {
+        free_page *last;
+        take_global((free_page **)&res, &last, 1);
+    }
+    assert(res);
+    return res;
 }
 
 void *malloc(size_t sz) {
     assert(sz <= 4096);
-    free_page *res = freelist_head;
-    assert(res);
-    freelist_head = res->next;
+    if (PerCpu *pc = percpu()) {
+        void *res = pc->alloc_zeroed();
+        assert(res);
+        return res;
+    }
+    void *res = malloc_dirty();
     memset(res, 0, 4096);
-    used_pages++;
     return res;
 }
 
-uintptr_t allocate_frame() {
-    return ToPhysAddr(malloc(4096));
+void stat() {
+    u32 nfree = free_pages;
+    for (size_t i = 0; i < n_cpus; i++) {
+        nfree += cpus[i]->count + cpus[i]->zeroed_count;
+    }
+    const u32 used_pages = total_pages - nfree;
+    printf("%u/%u pages used (%uKiB/%uKiB)\n", used_pages, total_pages,
+            used_pages * 4, total_pages * 4);
+    for (size_t i = 0; i < n_cpus; i++) {
+        printf("CPU %zu: ", i);
+        cpus[i]->stat();
+    }
 }
 
-void init(const mboot::Info& info, u32 memory_start, u64 memory_end) {
+// Direct map of physical memory at direct_map_base. A single PML4 entry is
+// used, which limits us to 512GiB of physical address space. The PDP (and the
+// PDs, when 1GiB pages are not supported) are shared by all address spaces,
+// so only the PML4 entry needs copying into new page tables.
+static const u64 DIRECT_MAP_SIZE = (u64)1 << 39;
+static u64 direct_map_pml4e;
+static u64 *direct_map_pdp;
+static bool direct_map_1gb;
+
+namespace pte {
+    enum : u64 {
+        Present = 1,
+        Write = 2,
+        WriteThrough = 8,
+        NoCache = 0x10,
+        PageSize = 0x80,
+        NoExec = (u64)1 << 63,
+        Flags = NoExec | Write | Present,
+    };
+}
+
+// Until the page allocator is up, page tables for the direct map are taken
+// from the start of free memory (which is below 1GiB and thus accessible).
+static uintptr_t early_alloc_next;
+
+u64 *alloc_table() {
+    u64 *res;
+    if (early_alloc_next) {
+        res = PhysAddr<u64>(early_alloc_next);
+        early_alloc_next += 0x1000;
+        memset(res, 0, 0x1000);
+    } else {
+        res = (u64 *)malloc(0x1000);
+    }
+    return res;
+}
+
+// Add [start,end) to the direct map, rounding out to whole large pages.
+void direct_map_range(uintptr_t start, uintptr_t end) {
+    assert(end <= DIRECT_MAP_SIZE);
+    const uintptr_t gb = 1 << 30, mb2 = 1 << 21;
+    for (uintptr_t p = start & -gb; p < end; p += gb) {
+        u64 &pdpe = direct_map_pdp[p >> 30];
+        if (direct_map_1gb) {
+            pdpe = p | pte::PageSize | pte::Flags;
+            continue;
+        }
+        if (!(pdpe & pte::Present)) {
+            pdpe = ToPhysAddr(alloc_table()) | pte::Write | pte::Present;
+        }
+        u64 *pd = PhysAddr<u64>(pdpe & 0xffffffffff000);
+        const uintptr_t s = p < start ? start & -mb2 : p;
+        const uintptr_t e = p + gb < end ? p + gb : end;
+        for (uintptr_t q = s; q < e; q += mb2) {
+            pd[(q >> 21) & 511] = q | pte::PageSize | pte::Flags;
+        }
+    }
+}
+
+// Map device registers at paddr into the direct map, uncached. The whole 2MiB
+// around it is mapped the same way, which is fine for things like the local
+// APIC up near 4GiB where there's no RAM.
+void direct_map_mmio(uintptr_t paddr) {
+    assert(paddr < DIRECT_MAP_SIZE);
+    const uintptr_t mb2 = 1 << 21;
+    u64 &pdpe = direct_map_pdp[paddr >> 30];
+    if (!(pdpe & pte::Present) || (pdpe & pte::PageSize)) {
+        // Split the 1GiB page (if any) into 2MiB pages with the same flags.
+        u64 *pd = alloc_table();
+        if (pdpe & pte::Present) {
+            for (uintptr_t i = 0; i < 512; i++) {
+                pd[i] = pdpe + i * mb2;
+            }
+        }
+        pdpe = ToPhysAddr(pd) | pte::Write | pte::Present;
+    }
+    u64 *pd = PhysAddr<u64>(pdpe & 0xffffffffff000);
+    pd[(paddr >> 21) & 511] = (paddr & -mb2) | pte::PageSize | pte::Flags
+        | pte::NoCache | pte::WriteThrough;
+    asm volatile("invlpg (%0)" :: "r"(PhysAddr<u8>(paddr)) : "memory");
+}
+
+void init_direct_map() {
+    direct_map_1gb = x86::cpuid(0x80000001).edx & (1 << 26);
+    direct_map_pdp = alloc_table();
+    direct_map_pml4e = ToPhysAddr(direct_map_pdp) | pte::Write | pte::Present;
+    // Install it in the boot page tables. New address spaces copy it from
+    // direct_map_pml4e.
+    PhysAddr<u64>(x86::cr3())[(direct_map_base >> 39) & 511] = direct_map_pml4e;
+}
+
+void init(const mboot::Info& info, u32 memory_start) {
     assert(info.has(mboot::MemoryMap));
-    auto mmap = PhysAddr<const mboot::MemoryMapItem>(info.mmap_addr);
-    auto mmap_end = add_byte_offset(mmap, info.mmap_length);
-    size_t n = 0;
-    while (mmap < mmap_end) {
+    const auto mmap_start = PhysAddr<const mboot::MemoryMapItem>(info.mmap_addr);
+    const auto mmap_end = add_byte_offset(mmap_start, info.mmap_length);
+    auto next = [](const mboot::MemoryMapItem *item) {
+        return add_byte_offset(item, 4 + item->item_size);
+    };
+
+    early_alloc_next = (memory_start + 0xfff) & ~0xfff;
+    init_direct_map();
+
+    for (auto mmap = mmap_start; mmap < mmap_end; mmap = next(mmap)) {
         printf("%p: start=%#lx length=%#lx\n", mmap,
                 mmap->start, mmap->length);
+        if (mmap->item_type == mboot::MemoryTypeMemory) {
+            uintptr_t e = mmap->start + mmap->length;
+            if (e > DIRECT_MAP_SIZE) e = DIRECT_MAP_SIZE;
+            if (mmap->start >= e) continue;
+            direct_map_range(mmap->start, e);
+            if (e >> 12 > max_pfn) max_pfn = e >> 12;
+        }
+    }
+    printf("Direct map of %luMiB at %p using %s pages\n",
+            max_pfn >> 8, (void *)direct_map_base,
+            direct_map_1gb ? "1GiB" : "2MiB");
+
+    // The direct map's page tables had to be accessible through the kernel
+    // window, everything from here on can be anywhere.
+    assert(early_alloc_next <= (uintptr_t)-kernel_base);
+    memory_start = early_alloc_next;
+    early_alloc_next = 0;
 
+    // Put the frame array in the first free memory with enough room, which
+    // is usually right after the page tables.
+    const size_t frames_size = (max_pfn * sizeof(Frame) + 0xfff) & ~0xfff;
+    uintptr_t frames_start = 0;
+    for (auto mmap = mmap_start; mmap < mmap_end; mmap = next(mmap)) {
         if (mmap->item_type == mboot::MemoryTypeMemory) {
-            uintptr_t p = mmap->start;
-            const uintptr_t e = p + mmap->length;
-            while (p < e) {
-                if (memory_start <= p && p < memory_end) {
-                    used_pages++;
-                    free(PhysAddr<u8>(p));
-                    n++;
-                }
-                p += 4096;
+            uintptr_t p = (mmap->start + 0xfff) & ~0xfff;
+            uintptr_t e = (mmap->start + mmap->length) & ~0xfff;
+            if (p < memory_start) p = memory_start;
+            if (e > DIRECT_MAP_SIZE) e = DIRECT_MAP_SIZE;
+            if (p + frames_size <= e) {
+                frames_start = p;
+                break;
             }
         }
+    }
+    assert(frames_start);
+    const uintptr_t frames_end = frames_start + frames_size;
+    frames = PhysAddr<Frame>(frames_start);
+    memset((void *)frames, 0, frames_size);
+    printf("Frame array for %lu frames at %#lx..%#lx\n",
+            max_pfn, frames_start, frames_end);
 
-        mmap = add_byte_offset(mmap, 4 + mmap->item_size);
+    auto free_between = [](uintptr_t p, uintptr_t e) {
+        if (p < e) {
+            free_range(p >> 12, e >> 12);
+        }
+    };
+    for (auto mmap = mmap_start; mmap < mmap_end; mmap = next(mmap)) {
+        if (mmap->item_type == mboot::MemoryTypeMemory) {
+            uintptr_t p = (mmap->start + 0xfff) & ~0xfff;
+            uintptr_t e = (mmap->start + mmap->length) & ~0xfff;
+            if (p < memory_start) p = memory_start;
+            if (e > DIRECT_MAP_SIZE) e = DIRECT_MAP_SIZE;
+            if (p < frames_end && frames_start < e) {
+                free_between(p, frames_start);
+                free_between(frames_end, e);
+            } else {
+                free_between(p, e);
+            }
+        }
     }
 
-    // We added one for each page, then "freed" it, so this should be 0
-    assert(!used_pages);
+    const size_t n = free_pages;
     total_pages = n;
     printf("Found %zu pages for %zuMiB of memory\n", n, (n * 4 + 1023) / 1024);
 }
@@ -31,8 +31,15 @@ enum ProcFlags {
 // Process has had a page fault that requires a response from a backer, or has
 // requested a page paged in.
 // proc.fault_addr is the address that faulted/was requested.
-    PFault = 5
-
+    PFault = 5,
+// Sending the reply half of a replywait. When the send finishes, the syscall
+// is restarted as a receive from recv_from (see syscall::ipc_replywait).
+    ReplyWait = 6,
+// Together with FastRet: the kernel has put a message in rax, rdi, rsi, rdx
+// and r8-r10, so those are restored too (with msgret instead of fastret).
+// The process is still returned to with sysret, which is only correct if it
+// entered the kernel with a syscall.
+    MsgRegs = 7,
 };
 u64 mask(ProcFlags flag) {
     return 1 << flag;
@@ -40,6 +47,17 @@ u64 mask(ProcFlags flag) {
 using x86::Regs;
 using x86::SavedRegs;
 
+// Scheduling priorities, 0 is the highest. A runnable process always runs
+// before any lower priority ones, and within a priority they take turns in
+// timeslices of SLICE_TICKS timer ticks.
+static const u8 NPRIO = 8;
+static const u8 DEFAULT_PRIO = 4;
+static const u8 SLICE_TICKS = 2;
+
+struct Process;
+static Process *all_processes;
+static Process **last_process = &all_processes;
+
 struct Process {
     // First: fields shared with asm code...
     union {
@@ -59,14 +77,115 @@ struct Process {
     RefCnt<AddressSpace> aspace;
     AddressSpace *waiting_for;
     uintptr_t fault_addr;
+    uintptr_t recv_from;
+    // If set, the process only runs on this CPU.
+    cpu::Cpu *pinned;
+    // The CPU the process last ran on.
+    cpu::Cpu *last_cpu;
+    // The priority set by the process itself, and the one it's scheduled
+    // with, which may be higher while serving calls (see lend).
+    u8 base_priority;
+    u8 priority;
+    // The run queue the process is on, see cpu::Cpu::queue.
+    u8 queued_priority;
+    // Timer ticks left before it has to let others with the same priority
+    // run. Refilled when it runs out.
+    u8 slice_left;
+    // While waiting for the reply to a call, the process serving it and the
+    // priority lent to it.
+    Process *lent_to;
+    u8 lent_priority;
+    // Priorities lent to us by callers waiting for a reply, counted per
+    // priority.
+    u16 loans[NPRIO];
+    // TSC cycles spent running in user mode, and in the kernel handling its
+    // syscalls and faults.
+    u64 user_cycles, kernel_cycles;
+    // All processes, for statistics.
+    Process *next_process;
+    // Message buffer registered with SYS_MSGBUF, for message words that
+    // don't fit in registers. Pinned: the frame is referenced until the
+    // buffer is replaced, even if it gets unmapped.
+    u64 *msgbuf;
     // TODO FXSave
 
     Process(AddressSpace *aspace):
-        aspace(aspace)
+        aspace(aspace),
+        base_priority(DEFAULT_PRIO),
+        priority(DEFAULT_PRIO)
     {
         flags = 1 << FastRet;
         cr3 = aspace->cr3();
         rflags = x86::rflags::IF;
+        *last_process = this;
+        last_process = &next_process;
+    }
+    // Dropping the last process in an address space frees it too.
+    ~Process() {
+        assert(!is_queued() && !is(Running));
+        assert(!waiting_for);
+        assert(!lent_to);
+        set_msgbuf(0);
+        Process **pp = &all_processes;
+        while (*pp != this) {
+            pp = &(*pp)->next_process;
+        }
+        *pp = next_process;
+        if (last_process == &next_process) {
+            last_process = pp;
+        }
+    }
+
+    // Replace the message buffer with the frame at paddr, or none if 0.
+    void set_msgbuf(uintptr_t paddr) {
+        if (msgbuf) {
+            const uintptr_t old = ToPhysAddr(msgbuf);
+            aspace::put_frame(mem::frame(old), old);
+        }
+        msgbuf = nullptr;
+        if (paddr) {
+            mem::frame(paddr)->mapcount++;
+            msgbuf = PhysAddr<u64>(paddr);
+        }
+    }
+
+    // The highest of our own priority and those lent to us.
+    void update_priority() {
+        priority = base_priority;
+        for (u8 i = 0; i < base_priority; i++) {
+            if (loans[i]) {
+                priority = i;
+                break;
+            }
+        }
+    }
+
+    // Lend our priority and what's left of our timeslice to the process
+    // that received our call, so that it doesn't run with less than we
+    // would have while we wait for it. Chains of calls pass it on.
+    void lend(Process *callee) {
+        assert(!lent_to);
+        lent_to = callee;
+        lent_priority = priority;
+        callee->loans[priority]++;
+        callee->update_priority();
+        callee->slice_left = slice_left;
+    }
+
+    // Got a reply (or any other message) while waiting for a call to
+    // finish, take back the priority and whatever the replier has left of
+    // the timeslice.
+    void end_loan(Process *replier) {
+        if (!lent_to) {
+            return;
+        }
+        assert(lent_to->loans[lent_priority]);
+        lent_to->loans[lent_priority]--;
+        lent_to->update_priority();
+        if (replier == lent_to) {
+            slice_left = replier->slice_left;
+        }
+        lent_to = nullptr;
     }
 
     void assoc_handles(uintptr_t j, Process *other, uintptr_t i) {
@@ -90,16 +209,6 @@ struct Process {
         aspace->delete_handle(handle);
     }
 
-    void wait_for(AddressSpace *otherspace) {
-        otherspace->add_waiter(this);
-    }
-    void add_waiter(Process *other) {
-        other->wait_for(aspace.get());
-    }
-    void remove_waiter(Process *other) {
-        aspace->remove_waiter(other);
-    }
-
     bool is(ProcFlags flag) const {
         return flags & (1 << flag);
     }
@@ -128,18 +237,64 @@ struct Process {
 
 namespace aspace {
 
+void fail_waiters(DList<Process> &list) {
+    while (Process *p = list.pop()) {
+        log(aspace, "%s: peer went away, failing its syscall\n", p->name());
+        p->waiting_for = nullptr;
+        // A caller waiting for its reply lent its priority to a process in
+        // the dead address space, which is gone already.
+        p->lent_to = nullptr;
+        p->flags &= ~(proc::mask(proc::InSend) | proc::mask(proc::InRecv)
+                | proc::mask(proc::PFault) | proc::mask(proc::ReplyWait)
+                | proc::mask(proc::MsgRegs));
+        p->regs.rax = -1;
+        wake(p);
+    }
+}
+
+void AddressSpace::delete_handle(Handle *handle) {
+    // Anyone still waiting on the handle can now only be matched by open
+    // receives and unassociated senders.
+    while (Process *p = handle->senders.pop()) {
+        waiters.append(p);
+    }
+    sending.remove(handle);
+    while (Process *p = handle->receivers.pop()) {
+        blocked.append(p);
+        p->waiting_for = this;
+    }
+    handle->dissociate();
+    handle->set_otherspace(nullptr);
+    Handle* existing = handles.remove(handle->key());
+    assert(existing == handle);
+    delete handle;
+}
+
 Process *AddressSpace::pop_sender(Handle *target) {
-    for (auto p: waiters) {
-        if (p->is(proc::InSend)
-            && (!target
-                || (target->otherspace == p->aspace.get()
-                    && target->other->key() == p->regs.rdi))) {
-            remove_waiter(p);
+    if (!target) {
+        target = sending.head;
+        if (!target) {
+            Process *p = waiters.pop();
+            if (p) {
+                p->waiting_for = nullptr;
+            }
             return p;
         }
+        // Round-robin between handles with senders.
+        sending.remove(target);
+        sending.append(target);
     }
-
-    return nullptr;
+    Process *p = target->senders.pop();
+    if (p) {
+        log(waiters, "%s pop_sender(%#lx): found %s\n", name(), target->key(), p->name());
+        assert(p->is(proc::InSend));
+        assert(p->waiting_for == this);
+        p->waiting_for = nullptr;
+        if (!target->senders.head) {
+            sending.remove(target);
+        }
+    }
+    return p;
 }
 
 Process *AddressSpace::pop_recipient(Handle *source) {
@@ -149,25 +304,20 @@ Process *AddressSpace::pop_pfault_recipient(Handle *source) {
     return pop_recipient(source, proc::mask(proc::InRecv) | proc::mask(proc::PFault));
 }
 Process *AddressSpace::pop_recipient(Handle *source, uintptr_t ipc_state) {
-    // Iterate waiters, find a "remote" process that can receive something from
-    // source.
+    // Find a "remote" process receiving from the other end of source. Usually
+    // the first one matches, but page-fault and normal receives can be
+    // waiting on the same handle.
     Handle *other = source->other;
-    for (auto p: waiters) {
+    if (!other) {
+        return nullptr;
+    }
+    for (auto p: other->receivers) {
         if (p->ipc_state() == ipc_state) {
-            auto rcpt = p->find_handle(p->regs.rdi);
-            log(waiters,
-                    "%s get_recipient(%#lx): found %s receiving from %p (looking for %p)\n",
-                    name(), source->key(), p->name(), rcpt, other);
-            // If there was no handle, we don't expect to find that process
-            // here - pop_open_recipient would be used for that.
-            assert(rcpt);
-            if (!rcpt || rcpt == other) {
-                remove_waiter(p);
-                return p;
-            }
-        } else {
-            log(waiters, "%s get_recipient(%#lx): found %s in state %lu (wanted %lu)\n",
-                    name(), source->key(), p->name(), p->ipc_state(), ipc_state);
+            log(waiters, "%s get_recipient(%#lx): found %s\n",
+                    name(), source->key(), p->name());
+            other->receivers.remove(p);
+            p->waiting_for = nullptr;
+            return p;
         }
     }
     log(waiters, "%s get_recipient(%#lx): no match\n", name(), source->key());
@@ -189,20 +339,35 @@ Process *AddressSpace::pop_open_recipient() {
     return nullptr;
 }
 
-void AddressSpace::add_waiter(Process *p)
+Process *AddressSpace::peek_open_recipient() const {
+    Process *p = blocked.head;
+    return p && p->ipc_state() == proc::mask(proc::InRecv) ? p : nullptr;
+}
+
+void AddressSpace::add_sender(Process *p, Handle *h)
 {
-    log(waiters, "%s adds waiter %s\n", name(), p->name());
+    log(waiters, "%s adds sender %s\n", name(), p->name());
+    assert(h->otherspace == this);
     assert(!p->waiting_for);
     assert(!p->is_queued());
-    waiters.append(p);
+    if (Handle *g = h->other) {
+        if (!g->senders.head) {
+            sending.append(g);
+        }
+        g->senders.append(p);
+    } else {
+        waiters.append(p);
+    }
     p->waiting_for = this;
 }
-void AddressSpace::remove_waiter(Process *p)
+void AddressSpace::add_receiver(Process *p, Handle *h)
 {
-    log(waiters, "%s removes waiter %s\n", name(), p->name());
-    assert(p->waiting_for == this || p->waiting_for == nullptr);
-    waiters.remove(p);
-    p->waiting_for = nullptr;
+    log(waiters, "%s receives from %#lx\n", p->name(), h->key());
+    assert(p->aspace.get() == this);
+    assert(!p->waiting_for);
+    assert(!p->is_queued());
+    h->receivers.append(p);
+    p->waiting_for = h->otherspace;
 }
 void AddressSpace::add_blocked(Process *p)
 {
@@ -17,12 +17,17 @@ public:
         other.ptr_ = nullptr;
     }
     void operator=(RefCnt&& other) {
+        T *old = ptr_;
         ptr_ = other.ptr_;
         other.ptr_ = nullptr;
+        if (old) old->release();
     }
     void operator=(const RefCnt& other) {
+        // Add the new reference first, in case it's the same object.
+        if (other.ptr_) other.ptr_->addref();
+        T *old = ptr_;
         ptr_ = other.ptr_;
-        if (ptr_) ptr_->addref();
+        if (old) old->release();
     }
 
     void reset(nullptr_t p = nullptr) {
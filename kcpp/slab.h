@@ -0,0 +1,183 @@
+namespace slab {
+
+// Size-class allocator for kernel objects. Each cache owns a number of slabs,
+// which are single pages from mem::malloc with a Slab header at the start and
+// the rest of the page carved up into equal-sized objects.
+//
+// Since the header is at the start of the page, an object pointer is never
+// page-aligned. Allocations too big for any size class get a whole page, so
+// free() can tell them apart just by looking at the low bits of the pointer.
+
+struct Cache;
+
+struct free_object {
+    free_object *next;
+};
+
+struct Slab {
+    DListNode<Slab> node;
+    Cache *cache;
+    free_object *freelist;
+    u16 inuse;
+};
+DLIST_NODE(Slab, node);
+
+struct Cache {
+    const char *name;
+    u16 size;
+    // Offset of the first object, i.e. sizeof(Slab) rounded up to the
+    // alignment of the object size. See object_offset.
+    u16 first;
+    u16 per_slab;
+
+    // Slabs with some free objects. Completely full slabs aren't on any
+    // list, they get put back on partial when an object is freed.
+    DList<Slab> partial;
+    // A single empty slab is kept around to avoid bouncing pages back and
+    // forth to the page allocator when one object is allocated and freed
+    // repeatedly.
+    Slab *empty;
+
+    u32 slabs;
+    u32 inuse;
+    u64 allocs, frees;
+
+    Slab *new_slab() {
+        // Objects are cleared on allocation, so only the header needs to be
+        // initialized here.
+        Slab *slab = (Slab *)mem::malloc_dirty();
+        slab->node = DListNode<Slab>();
+        slab->cache = this;
+        slab->inuse = 0;
+        // Thread all objects into the free list, lowest address first.
+        free_object **p = &slab->freelist;
+        for (u16 i = 0; i < per_slab; i++) {
+            free_object *obj = (free_object *)((u8 *)slab + first + i * size);
+            *p = obj;
+            p = &obj->next;
+        }
+        *p = nullptr;
+        slabs++;
+        log(slab, "%s: new slab %p, %u objects\n", name, slab, per_slab);
+        return slab;
+    }
+
+    void free_slab(Slab *slab) {
+        assert(!slab->inuse);
+        log(slab, "%s: freeing slab %p\n", name, slab);
+        slabs--;
+        mem::free(slab);
+    }
+
+    void *alloc() {
+        Slab *slab = partial.head;
+        if (!slab) {
+            slab = latch(empty);
+            if (!slab) {
+                slab = new_slab();
+            }
+            partial.append(slab);
+        }
+        free_object *obj = slab->freelist;
+        assert(obj);
+        slab->freelist = obj->next;
+        if (!slab->freelist) {
+            partial.remove(slab);
+        }
+        slab->inuse++;
+        inuse++;
+        allocs++;
+        // Most kernel objects assume 0-initialization.
+        memset(obj, 0, size);
+        return obj;
+    }
+
+    void free(Slab *slab, void *p) {
+        assert(slab->cache == this);
+        assert(slab->inuse);
+        free_object *obj = (free_object *)p;
+        if (!slab->freelist) {
+            // Was full, now has one free object again.
+            partial.append(slab);
+        }
+        obj->next = slab->freelist;
+        slab->freelist = obj;
+        slab->inuse--;
+        inuse--;
+        frees++;
+
+        if (!slab->inuse) {
+            partial.remove(slab);
+            if (Slab *old = latch(empty, slab)) {
+                free_slab(old);
+            }
+        }
+    }
+
+    void stat() const {
+        const u32 capacity = slabs * per_slab;
+        printf("%s: %u/%u objects in %u slabs (%lu allocs, %lu frees)\n",
+            name, inuse, capacity, slabs, allocs, frees);
+    }
+};
+
+constexpr u16 object_align(u16 size) {
+    // Largest power of two dividing the size, at most 64 bytes.
+    return (size & -size) < 64 ? size & -size : 64;
+}
+constexpr u16 object_offset(u16 size) {
+    return (sizeof(Slab) + object_align(size) - 1) & -object_align(size);
+}
+
+#define SIZE_CLASS(n) \
+    { "size-" #n, n, object_offset(n), (4096 - object_offset(n)) / n, \
+      DList<Slab>(), nullptr, 0, 0, 0, 0 }
+static Cache caches[] = {
+    SIZE_CLASS(16),
+    SIZE_CLASS(32),
+    SIZE_CLASS(48),
+    SIZE_CLASS(64),
+    SIZE_CLASS(96),
+    SIZE_CLASS(128),
+    SIZE_CLASS(192),
+    SIZE_CLASS(256),
+    SIZE_CLASS(512),
+    SIZE_CLASS(1024),
+};
+#undef SIZE_CLASS
+
+Cache *find_cache(size_t sz) {
+    for (Cache &c: caches) {
+        if (sz <= c.size) {
+            return &c;
+        }
+    }
+    return nullptr;
+}
+
+void *malloc(size_t sz) {
+    if (Cache *c = find_cache(sz)) {
+        return c->alloc();
+    }
+    return mem::malloc(sz);
+}
+
+void free(void *p) {
+    if (!((uintptr_t)p & 0xfff)) {
+        // Whole page (or null)
+        mem::free(p);
+        return;
+    }
+    Slab *slab = (Slab *)((uintptr_t)p & -0x1000);
+    slab->cache->free(slab, p);
+}
+
+void stat() {
+    for (const Cache &c: caches) {
+        if (c.slabs) {
+            c.stat();
+        }
+    }
+}
+
+}
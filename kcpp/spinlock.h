@@ -0,0 +1,34 @@
+// Ticket spinlock. The kernel always runs with interrupts disabled, so there's
+// no need to save and restore the interrupt flag when taking a lock.
+struct SpinLock {
+    u16 next;
+    u16 owner;
+
+    void lock() {
+        const u16 ticket = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+        while (__atomic_load_n(&owner, __ATOMIC_ACQUIRE) != ticket) {
+            asm volatile("pause" ::: "memory");
+        }
+    }
+    void unlock() {
+        __atomic_store_n(&owner, (u16)(owner + 1), __ATOMIC_RELEASE);
+    }
+    bool is_locked() const {
+        return __atomic_load_n(&next, __ATOMIC_RELAXED)
+            != __atomic_load_n(&owner, __ATOMIC_RELAXED);
+    }
+};
+
+// Holds a lock until the end of the scope.
+class SpinLockGuard {
+    SpinLock &lock_;
+public:
+    SpinLockGuard(SpinLock &lock): lock_(lock) {
+        lock_.lock();
+    }
+    ~SpinLockGuard() {
+        lock_.unlock();
+    }
+    SpinLockGuard(const SpinLockGuard&) = delete;
+    SpinLockGuard& operator=(const SpinLockGuard&) = delete;
+};
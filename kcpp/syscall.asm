@@ -2,6 +2,9 @@
 
 bits 64
 
+; Must match syscall.h
+MSG_USER	equ	16
+
 ; callee-save: rbp, rbx, r12-r15
 ; caller-save: rax, rcx, rdx, rsi, rdi, r8-r11
 %macro clear_clobbered_syscall 0
@@ -136,6 +139,21 @@ proc fastret
 	ud2
 endproc
 
+; msgret: return to a process that's receiving a message. Like fastret it
+; returns with sysret, so the process must have entered the kernel with a
+; syscall, but loads the message registers rax, rdi, rsi, rdx, r8-r10 too.
+proc msgret
+	sub	rdi, proc
+	load_regs rdi,  rbp,rbx,r12,r13,r14,r15
+	load_regs rdi,  rax,rsi,rdx,r8,r9,r10
+	mov	rsp, [rdi + proc.rsp]
+	mov	rcx, [rdi + proc.rip]
+	mov	r11, [rdi + proc.rflags]
+	mov	rdi, [rdi + proc.rdi]
+	swapgs
+	o64 sysret
+endproc
+
 ; section .text.syscall_entry_stub, exec
 ; syscall_entry_stub:
 proc syscall_entry_stub
@@ -163,6 +181,28 @@ proc syscall_entry_stub
 	;   r10 (caller-save) is used instead of rcx for argument 4
 	mov	rcx, r10
 
+	; IPC fast path. syscall_ipc_fast takes the same arguments as syscall
+	; and only returns if it couldn't handle it, so keep them around.
+	cmp	qword [rsp], MSG_USER
+	jb	.slow
+	push	rdi
+	push	rsi
+	push	rdx
+	push	rcx
+	push	r8
+	push	r9
+	push	qword [rsp + 48]
+	extern syscall_ipc_fast
+	call	syscall_ipc_fast
+	add	rsp, 8
+	pop	r9
+	pop	r8
+	pop	rcx
+	pop	rdx
+	pop	rsi
+	pop	rdi
+.slow:
+
 	; The syscall function's prototype is:
 	; fn(rdi,rsi,rdx,r10,r8,r9,  rax)
 
@@ -22,15 +22,61 @@ enum syscalls_builtins {
     SYS_GRANT = 8,
     SYS_PULSE = 9,
     SYS_YIELD = 10,
+    // arg0 = new priority, 0 is the highest (see proc::NPRIO)
+    SYS_SETPRIO = 11,
+    // arg0 = index of a process, 0 and up
+    // Returns 0 and the process's statistics, or -1 if there's no such
+    // process (see syscall_procstat).
+    SYS_PROCSTAT = 12,
+    // arg0 = page-aligned address in an anonymous read-write mapping, or 0
+    // Registers (or with 0, drops) the message buffer, see MSG_WORDS_MASK.
+    // Returns 0, or -1 if the address isn't usable.
+    SYS_MSGBUF = 13,
+    // arg0 = address of an array of BatchEntry, arg1 = number of entries
+    // Runs entries in order until one would block (see syscall_batch).
+    // Returns the number of entries done (-1 from kernels without batches).
+    SYS_BATCH = 14,
+    // arg0 = LAPIC_* flags
+    // For drivers that use the local APIC, see syscall_lapic. Returns 0.
+    SYS_LAPIC = 15,
 
     MSG_USER = 16,
     MSG_MASK = 0xff,
+    // Number of extra message words, copied from the start of the sender's
+    // message buffer to the start of the receiver's. The receiver gets the
+    // number actually copied: 0 if either has no buffer, and at most
+    // MSG_MAX_WORDS.
+    MSG_WORDS_SHIFT = 16,
+    MSG_WORDS_MASK = 0xff << MSG_WORDS_SHIFT,
+    MSG_MAX_WORDS = 64,
+    // Copy a string from the sender's address space to the receiver's. Both
+    // are described in the message buffers, after the message words:
+    // MSGBUF_SEND_* in the sender's and MSGBUF_RECV_* in the receiver's. The
+    // number of bytes copied is stored in the receiver's MSGBUF_RECV_LEN.
+    // Without a receiver message buffer, nothing is copied and the flag is
+    // cleared in the received message.
+    MSG_STRING = 1 << 24,
+    MSG_MAX_STRING = 64 * 1024,
+};
+
+enum lapic_flags {
+    // Take over the local APIC timer.
+    LAPIC_TIMER = 1,
+};
+
+enum msgbuf_words {
+    MSGBUF_SEND_ADDR = MSG_MAX_WORDS,
+    MSGBUF_SEND_LEN,
+    MSGBUF_RECV_ADDR,
+    MSGBUF_RECV_SIZE,
+    MSGBUF_RECV_LEN,
 };
 
 enum msg_kind {
     MSG_KIND_MASK = 0x300,
     MSG_KIND_SEND = 0x000,
     MSG_KIND_CALL = 0x100,
+    MSG_KIND_REPLYWAIT = 0x200,
 };
 
 u64 portio(u16 port, u8 op, u32 data) {
@@ -96,7 +142,79 @@ NORETURN void syscall_return(Process *p, u64 res) {
     getcpu().syscall_return(p, res);
 }
 
-NORETURN void transfer_message(Process *target, Process *source) {
+// Copy len bytes from src in one address space to dst in another, faulting
+// in pages as needed. Returns the number of bytes copied, which is less than
+// len if either side runs into a page the kernel can't use.
+size_t copy_string(AddressSpace *to, uintptr_t dst, AddressSpace *from, uintptr_t src, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        const uintptr_t s = src + done, d = dst + done;
+        size_t n = len - done;
+        if (n > 0x1000 - (s & 0xfff)) {
+            n = 0x1000 - (s & 0xfff);
+        }
+        if (n > 0x1000 - (d & 0xfff)) {
+            n = 0x1000 - (d & 0xfff);
+        }
+        const uintptr_t spage = from->user_page(s, false);
+        const uintptr_t dpage = to->user_page(d, true);
+        if (!spage || !dpage || !mem::frame(spage) || !mem::frame(dpage)) {
+            break;
+        }
+        memcpy(PhysAddr<u8>(dpage + (d & 0xfff)), PhysAddr<u8>(spage + (s & 0xfff)), n);
+        done += n;
+    }
+    log(string, "copy_string: %lu/%lu bytes %lx -> %lx\n", done, len, src, dst);
+    return done;
+}
+
+void transfer_string(Process *target, Process *source) {
+    if (!target->msgbuf) {
+        target->regs.rax &= ~(u64)MSG_STRING;
+        return;
+    }
+    u64 *t = target->msgbuf;
+    size_t len = 0;
+    if (const u64 *s = source->msgbuf) {
+        len = s[MSGBUF_SEND_LEN] < t[MSGBUF_RECV_SIZE] ? s[MSGBUF_SEND_LEN] : t[MSGBUF_RECV_SIZE];
+        if (len > MSG_MAX_STRING) {
+            len = MSG_MAX_STRING;
+        }
+        len = copy_string(target->aspace.get(), t[MSGBUF_RECV_ADDR],
+                source->aspace.get(), s[MSGBUF_SEND_ADDR], len);
+    }
+    t[MSGBUF_RECV_LEN] = len;
+}
+
+// Copy between user memory and the kernel, faulting in pages as needed.
+// Returns false if the kernel can't use some page in the range.
+bool copy_user(AddressSpace *as, uintptr_t vaddr, void *buf, size_t len, bool write) {
+    u8 *kbuf = (u8 *)buf;
+    while (len) {
+        size_t n = 0x1000 - (vaddr & 0xfff);
+        if (n > len) {
+            n = len;
+        }
+        const uintptr_t page = as->user_page(vaddr, write);
+        if (!page || !mem::frame(page)) {
+            return false;
+        }
+        u8 *user = PhysAddr<u8>(page + (vaddr & 0xfff));
+        if (write) {
+            memcpy(user, kbuf, n);
+        } else {
+            memcpy(kbuf, user, n);
+        }
+        vaddr += n;
+        kbuf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Copy the message and update the IPC state of both processes, without
+// making either of them run.
+void copy_message(Process *target, Process *source) {
     transfer_set_handle(target, source);
     log(transfer_message, "transfer_message %s <- %s\n", target->name(), source->name());
 
@@ -106,24 +224,66 @@ NORETURN void transfer_message(Process *target, Process *source) {
     target->regs.r8 = source->regs.r8;
     target->regs.r9 = source->regs.r9;
     target->regs.r10 = source->regs.r10;
+    if (u64 words = (source->regs.rax & MSG_WORDS_MASK) >> MSG_WORDS_SHIFT) {
+        if (!target->msgbuf || !source->msgbuf) {
+            words = 0;
+        } else if (words > MSG_MAX_WORDS) {
+            words = MSG_MAX_WORDS;
+        }
+        memcpy(target->msgbuf, source->msgbuf, words * sizeof(u64));
+        target->regs.rax = (target->regs.rax & ~MSG_WORDS_MASK) | words << MSG_WORDS_SHIFT;
+    }
+    if (source->regs.rax & MSG_STRING) {
+        transfer_string(target, source);
+    }
 
     target->unset(proc::InRecv);
-    target->unset(proc::FastRet);
+    target->set(proc::MsgRegs);
     source->unset(proc::InSend);
-    source->remove_waiter(target);
+    assert(!target->waiting_for && !source->waiting_for);
+
+    // The recipient might be a caller getting its reply.
+    target->end_loan(source);
+
+    if (source->is(proc::ReplyWait)) {
+        // The reply of a replywait had to wait for the recipient. Have the
+        // sender restart the syscall as a plain receive.
+        source->unset(proc::ReplyWait);
+        source->unset(proc::FastRet);
+        source->regs.rax = SYS_RECV;
+        source->regs.rdi = source->recv_from;
+        source->rip -= 2; // Length of the syscall instruction
+    }
+}
+
+// Copy the message and update the IPC state of both processes. Returns the
+// one that should run next, the other one is queued or waiting for a reply.
+Process *deliver_message(Process *target, Process *source) {
+    copy_message(target, source);
 
     Cpu& c = getcpu();
-    c.queue(target);
-    if (!source->ipc_state()) {
-        target->remove_waiter(source);
-        c.queue(source);
-    } else {
-        target->add_waiter(source);
+    if (source->ipc_state()) {
+        // A call, wait for the reply. The recipient runs in its place, with
+        // the caller's priority and timeslice until it replies.
+        source->lend(target);
+        source->aspace->add_receiver(source, source->find_handle(source->regs.rdi));
+        return target;
+    }
+    // Both can run. Usually the recipient goes first (e.g. a caller getting
+    // its reply), unless the sender is more important.
+    if (source->priority < target->priority) {
+        c.queue(target);
+        return source;
     }
-    c.run();
+    c.queue(source);
+    return target;
 }
 
-NORETURN void transfer_pulse(Process *target, uintptr_t key, uintptr_t events) {
+NORETURN void transfer_message(Process *target, Process *source) {
+    getcpu().handoff(deliver_message(target, source));
+}
+
+void deliver_pulse(Process *target, uintptr_t key, uintptr_t events) {
     // Apparently we need the source process for transfer_set_handle, but we
     // already know the key that we should set.
     target->regs.rax = SYS_PULSE;
@@ -131,12 +291,16 @@ NORETURN void transfer_pulse(Process *target, uintptr_t key, uintptr_t events) {
     target->regs.rsi = events;
 
     target->unset(proc::InRecv);
-    target->unset(proc::FastRet); // This really should be possible though
+    target->set(proc::MsgRegs);
     assert(target->is_runnable());
+}
+
+NORETURN void transfer_pulse(Process *target, uintptr_t key, uintptr_t events) {
+    deliver_pulse(target, key, events);
     getcpu().switch_to(target);
 }
 
-void send_or_block(Process *sender, Handle *h, u64 msg, u64 arg1, u64 arg2, u64 arg3, u64 arg4, u64 arg5) {
+void set_message(Process *sender, Handle *h, u64 msg, u64 arg1, u64 arg2, u64 arg3, u64 arg4, u64 arg5) {
     sender->regs.rax = msg;
     sender->regs.rdi = h->key();
     sender->regs.rsi = arg1;
@@ -144,6 +308,18 @@ void send_or_block(Process *sender, Handle *h, u64 msg, u64 arg1, u64 arg2, u64
     sender->regs.r8 = arg3;
     sender->regs.r9 = arg4;
     sender->regs.r10 = arg5;
+}
+
+// The address space on the other side of a handle has died, so nothing can be
+// sent or received through it anymore.
+NORETURN void dead_peer(Process *p, uintptr_t handle) {
+    log(ipc, "%s: peer of %lx is gone\n", p->name(), handle);
+    syscall_return(p, -1);
+}
+
+void send_or_block(Process *sender, Handle *h, u64 msg, u64 arg1, u64 arg2, u64 arg3, u64 arg4, u64 arg5) {
+    assert(h->otherspace);
+    set_message(sender, h, msg, arg1, arg2, arg3, arg4, arg5);
 
     if (auto p = sender->aspace->pop_recipient(h)) {
         log(ipc, "send_or_block: %s sends to (specific) %s\n", sender->name(), p->name());
@@ -153,14 +329,17 @@ void send_or_block(Process *sender, Handle *h, u64 msg, u64 arg1, u64 arg2, u64
         transfer_message(p, sender);
     } else {
         log(ipc, "send_or_block: no available recipient, %s waits for %s\n", sender->name(), h->otherspace->name());
-        sender->wait_for(h->otherspace);
+        h->otherspace->add_sender(sender, h);
     }
 }
 
 NORETURN void ipc_send(Process *p, u64 msg, u64 rcpt, u64 arg1, u64 arg2, u64 arg3, u64 arg4, u64 arg5) {
     auto handle = p->find_handle(rcpt);
-    log(ipc, "%s ipc_send to %lx (%s)\n", p->name(), rcpt, handle ? handle->otherspace->name() : NULL);
     assert(handle);
+    if (!handle->otherspace) {
+        dead_peer(p, rcpt);
+    }
+    log(ipc, "%s ipc_send to %lx (%s)\n", p->name(), rcpt, handle->otherspace->name());
     p->set(proc::InSend);
     send_or_block(p, handle, msg, arg1, arg2, arg3, arg4, arg5);
     log(ipc, "ipc_send: blocked\n");
@@ -170,6 +349,9 @@ NORETURN void ipc_send(Process *p, u64 msg, u64 rcpt, u64 arg1, u64 arg2, u64 ar
 NORETURN void ipc_call(Process *p, u64 msg, u64 rcpt, u64 arg1, u64 arg2, u64 arg3 = 0, u64 arg4 = 0, u64 arg5 = 0) {
     auto handle = p->find_handle(rcpt);
     assert(handle);
+    if (!handle->otherspace) {
+        dead_peer(p, rcpt);
+    }
     log(ipc, "%s ipc_call to %lx (%s)\n", p->name(), rcpt, handle->otherspace->name());
     p->set(proc::InSend);
     p->set(proc::InRecv);
@@ -179,14 +361,22 @@ NORETURN void ipc_call(Process *p, u64 msg, u64 rcpt, u64 arg1, u64 arg2, u64 ar
     getcpu().run();
 }
 
-NORETURN void ipc_recv(Process *p, u64 from) {
+// If next is set, it's a process (that's not queued) that should run if the
+// receive blocks.
+NORETURN void ipc_recv(Process *p, u64 from, Process *next = nullptr) {
     auto handle = from ? p->find_handle(from) : nullptr;
+    if (handle && !handle->otherspace) {
+        dead_peer(p, from);
+    }
     log(recv, "%s recv from %lx (%s)\n", p->name(), from,
             handle ? handle->otherspace->name() : "fresh");
     p->set(proc::InRecv);
     p->regs.rdi = from;
     if (auto sender = p->aspace->pop_sender(handle)) {
         log(recv, "%s recv: found sender %s\n", p->name(), sender->name());
+        if (next) {
+            getcpu().queue(next);
+        }
         transfer_message(p, sender);
         // noreturn
     }
@@ -194,32 +384,77 @@ NORETURN void ipc_recv(Process *p, u64 from) {
         log(recv, "%s recv: waiting for %s\n", p->name(), handle->otherspace->name());
         // TODO Handle cases where 'handle' is the handle with a pulse waiting.
         assert(!handle->events);
-        handle->otherspace->add_waiter(p);
+        p->aspace->add_receiver(p, handle);
     } else {
         if (auto h = p->aspace->pop_pending_handle()) {
             uintptr_t events = latch(h->events);
             log(pulse, "%s recv: got events %lx from %lx\n", p->name(), events, h->key());
+            if (next) {
+                getcpu().queue(next);
+            }
             transfer_pulse(p, h->key(), events);
         }
 
-        Cpu &c = getcpu();
-        if (c.irq_process == p && c.irq_delayed[0]) {
-            auto irqs = latch(c.irq_delayed[0]);
+        if (cpu::irq_process == p && cpu::irq_delayed[0]) {
+            auto irqs = latch(cpu::irq_delayed[0]);
             log(pulse, "%s recv: got pending IRQs %lx\n", p->name(), irqs);
+            if (next) {
+                getcpu().queue(next);
+            }
             transfer_pulse(p, 0, irqs);
         }
 
         log(recv, "%s recv: found no senders\n", p->name());
         p->aspace->add_blocked(p);
     }
+    if (next) {
+        getcpu().handoff(next);
+    }
     getcpu().run();
 }
 
+// Reply to rcpt with a plain send, unless it's 0, and then receive from
+// "from" like ipc_recv. The message registers are all used for the reply's
+// arguments except r10 (arg5), which holds the handle to receive from.
+NORETURN void ipc_replywait(Process *p, u64 msg, u64 rcpt, u64 arg1, u64 arg2, u64 arg3, u64 arg4, u64 from) {
+    if (!rcpt) {
+        ipc_recv(p, from);
+    }
+    auto handle = p->find_handle(rcpt);
+    assert(handle);
+    if (!handle->otherspace) {
+        dead_peer(p, rcpt);
+    }
+    log(ipc, "%s ipc_replywait to %lx (%s), from %lx\n", p->name(), rcpt,
+            handle->otherspace->name(), from);
+    p->set(proc::InSend);
+    // The recipient sees a plain send.
+    set_message(p, handle, (msg & ~MSG_KIND_MASK) | MSG_KIND_SEND, arg1, arg2, arg3, arg4, 0);
+    Process *target = p->aspace->pop_recipient(handle);
+    if (!target) {
+        target = handle->otherspace->pop_open_recipient();
+    }
+    if (!target) {
+        log(ipc, "ipc_replywait: blocked\n");
+        p->set(proc::ReplyWait);
+        p->recv_from = from;
+        handle->otherspace->add_sender(p, handle);
+        getcpu().run();
+    }
+    // The recipient (usually a caller waiting for this reply) runs next,
+    // unless the receive can finish right away.
+    copy_message(target, p);
+    ipc_recv(p, from, target);
+}
+
 NORETURN void syscall_pulse(Process *p, uintptr_t handle, uintptr_t bits) {
     auto h = p->find_handle(handle);
+    assert(h);
+    if (h && !h->otherspace) {
+        dead_peer(p, handle);
+    }
     log(pulse, "%s sending pulse %lx to %lx (%s)\n", p->name(), bits, handle,
             h ? h->otherspace->name() : "null");
-    assert(h);
     if (!h || !h->other) {
         syscall_return(p, 0); // FIXME Error code
     }
@@ -254,19 +489,19 @@ NORETURN void syscall_map(Process *p, uintptr_t handle, uintptr_t flags, uintptr
 	// anon: anonymous memory mapped on use
 	// anon|phys: similar to anonymous, but the backing is allocated
 	// immediately, the memory is "locked" (actually all allocations are),
-	// and the phys. address of the memory (always a single page) is
-	// returned in rax.
+	// and the phys. address of the memory is returned in rax. The memory is
+	// physically contiguous and aligned to 'offset' (if non-zero).
 
     // For DMA memory we want to allocate the memory right away so we can
     // return the address to the caller.
     if (!handle && (flags & MAP_DMA) == MAP_DMA) {
-        // Maybe require that offset == 0, since it's currently not used but we
-        // might find a use for it later? And then we'd not want stuff relying
-        // on garbage being OK.
-        offset = mem::allocate_frame();
-
-        // TODO Check that size == 4096, otherwise we'll give the process
-        // access to a whole bunch of extra physical memory.
+        size = (size + 0xfff) & ~0xfff;
+        offset = mem::allocate_contig(size >> 12, offset);
+        if (!offset) {
+            log(map_range, "%s: DMA allocation of %#lx bytes failed\n", p->name(), size);
+            syscall_return(p, 0);
+        }
+        p->aspace->add_dma_region(offset, size >> 12);
     }
 
     uintptr_t end_vaddr = vaddr + size;
@@ -295,6 +530,9 @@ NORETURN void syscall_pfault(Process *p, uintptr_t vaddr, uintptr_t flags) {
 
     auto h = p->find_handle(handle);
     assert(h);
+    if (!h->otherspace) {
+        dead_peer(p, handle);
+    }
     log(prefault, "%s prefault: mapped to %lx (%s) offset %lx\n", p->name(), handle, h->otherspace->name(), offsetFlags);
     p->set(proc::PFault);
     ipc_call(p, SYS_PFAULT, handle, offsetFlags & -4096, flags & offsetFlags);
@@ -306,6 +544,7 @@ NORETURN void syscall_pfault(Process *p, uintptr_t vaddr, uintptr_t flags) {
 NORETURN void syscall_grant(Process *p, uintptr_t handle, uintptr_t vaddr, uintptr_t flags) {
     using namespace aspace;
 
+    const bool move = flags & GRANT_MOVE;
     // TODO Error out instead of adjusting
     flags &= MAP_RWX;
 
@@ -313,11 +552,21 @@ NORETURN void syscall_grant(Process *p, uintptr_t handle, uintptr_t vaddr, uintp
     if (!h) {
         abort("GRANT for unknown handle\n");
     }
+    if (!h->otherspace) {
+        dead_peer(p, handle);
+    }
     if (!h->other) {
         abort("GRANT for unassociated handle\n");
     }
-    log(grant, "%s grant(%lx (%s) vaddr=%#lx flags=%lu)\n", p->name(), handle,
-            h->otherspace->name(), vaddr, flags);
+    log(grant, "%s grant(%lx (%s) vaddr=%#lx flags=%lu%s)\n", p->name(), handle,
+            h->otherspace->name(), vaddr, flags, move ? " move" : "");
+    // Check this before changing anything, the faulting process keeps
+    // waiting for a grant it can get.
+    Backing *moved = move ? p->aspace->movable_backing(vaddr) : nullptr;
+    if (move && !moved) {
+        log(grant, "%s grant: %#lx can't be moved\n", p->name(), vaddr);
+        syscall_return(p, -1);
+    }
 
     // Find faulted process in otherspace
     auto rcpt = p->aspace->pop_pfault_recipient(h);
@@ -346,11 +595,21 @@ NORETURN void syscall_grant(Process *p, uintptr_t handle, uintptr_t vaddr, uintp
     if (!paddr) {
         abort("Recursive fault required...\n");
     }
-    // TODO Find previously mapped page, release it if necessary
-    Sharing *sharing = p->aspace->find_add_sharing(vaddr, paddr);
-    assert(sharing->paddr == paddr);
-    h->otherspace->add_shared_backing(fault_addr | flags, sharing);
-    // TODO Add the PTE for the newly added page to save a page fault
+    if (Backing *old = h->otherspace->find_backing(fault_addr)) {
+        h->otherspace->unmap_backing(old);
+    }
+    if (move) {
+        // The granter loses the page (and gets a new one if it touches the
+        // address again), so the recipient owns the only mapping.
+        p->aspace->unmap_for_move(moved);
+        Backing *back = h->otherspace->add_backing((fault_addr & -0x1000) | flags | MAP_PHYS, paddr);
+        h->otherspace->add_pte(back->vaddr(), back->pte());
+    } else {
+        Sharing *sharing = p->aspace->find_add_sharing(vaddr, paddr);
+        assert(sharing->paddr == paddr);
+        h->otherspace->add_shared_backing(fault_addr | flags, sharing);
+        // TODO Add the PTE for the newly added page to save a page fault
+    }
 
     rcpt->unset(proc::PFault);
     if (rcpt->is(proc::InRecv)) {
@@ -371,13 +630,253 @@ NORETURN void syscall_yield(Process *p) {
     cpu.run();
 }
 
+// One operation in a SYS_BATCH array. msg and the arguments are the same as
+// for the corresponding syscall, with dst in rdi.
+struct BatchEntry {
+    u64 msg;
+    u64 dst;
+    u64 arg1, arg2, arg3;
+    // 0 when done, -1 for the entry that stopped the batch.
+    i64 result;
+};
+
+// Do one batch entry, unless it would block (or isn't supported in batches).
+// Processes that get a message or pulse are queued.
+bool run_batch_entry(Process *p, const BatchEntry &e) {
+    using namespace aspace;
+    switch (e.msg) {
+    case SYS_HMOD:
+        hmod(p, e.dst, e.arg1, e.arg2);
+        return true;
+    case SYS_PFAULT: {
+        // Only memory the kernel backs itself, anything else waits for a
+        // user-mode backer.
+        uintptr_t offsetFlags, handle;
+        if (!p->aspace->find_mapping(e.arg1, offsetFlags, handle) || handle) {
+            return false;
+        }
+        return p->aspace->user_page(e.arg1, e.arg2 & MAP_W);
+    }
+    case SYS_PULSE: {
+        Handle *h = p->find_handle(e.dst);
+        if (!h || !h->other) {
+            return false;
+        }
+        Process *rcpt = p->aspace->pop_recipient(h);
+        if (!rcpt) {
+            rcpt = h->otherspace->pop_open_recipient();
+        }
+        if (rcpt) {
+            deliver_pulse(rcpt, h->other->key(), latch(h->other->events) | e.arg1);
+            getcpu().queue(rcpt);
+        } else {
+            h->otherspace->pulse_handle(h->other, e.arg1);
+        }
+        return true;
+    }
+    }
+    // Otherwise only sends, to someone that's already waiting.
+    if (e.msg < MSG_USER || (e.msg & MSG_KIND_MASK) != MSG_KIND_SEND) {
+        return false;
+    }
+    Handle *h = p->find_handle(e.dst);
+    if (!h || !h->otherspace) {
+        return false;
+    }
+    Process *t = p->aspace->pop_recipient(h);
+    if (!t) {
+        t = h->otherspace->pop_open_recipient();
+    }
+    if (!t) {
+        return false;
+    }
+    set_message(p, h, e.msg, e.arg1, e.arg2, e.arg3, 0, 0);
+    copy_message(t, p);
+    getcpu().queue(t);
+    return true;
+}
+
+// Run a batch of non-blocking operations in one kernel entry. Stops at the
+// first entry that would block, which the caller can then do with the plain
+// syscall before submitting the rest again.
+NORETURN void syscall_batch(Process *p, uintptr_t vaddr, size_t count) {
+    static const size_t MAX_BATCH = 256;
+    Cpu &c = getcpu();
+    AddressSpace *as = p->aspace.get();
+    size_t n = 0;
+    for (; n < count && n < MAX_BATCH; n++) {
+        const uintptr_t addr = vaddr + n * sizeof(BatchEntry);
+        BatchEntry e;
+        if (!copy_user(as, addr, &e, sizeof(e), false)) {
+            break;
+        }
+        const uintptr_t result = addr + offsetof(BatchEntry, result);
+        e.result = 0;
+        if (!copy_user(as, result, &e.result, sizeof(e.result), true)) {
+            break;
+        }
+        if (!run_batch_entry(p, e)) {
+            e.result = -1;
+            copy_user(as, result, &e.result, sizeof(e.result), true);
+            break;
+        }
+    }
+    log(batch, "%s batch: %lu/%lu entries done\n", p->name(), n, count);
+    if (p->priority && c.ready_at(p->priority - 1)) {
+        // Woke up something more important.
+        p->regs.rax = n;
+        c.queue(p);
+        c.run();
+    }
+    syscall_return(p, n);
+}
+
+// Change the calling process's priority. Like yield, so that lowering the
+// priority lets anything more important run right away.
+NORETURN void syscall_setprio(Process *p, u64 prio) {
+    if (prio >= proc::NPRIO) {
+        prio = proc::NPRIO - 1;
+    }
+    p->base_priority = prio;
+    p->update_priority();
+    p->regs.rax = 0;
+    auto &cpu = getcpu();
+    cpu.queue(p);
+    cpu.run();
+}
+
+// Drivers that use the local APIC need to keep talking to the same one, and
+// the one that gets the IRQs (the timer driver sets up the logical destination
+// on the CPU it runs on). Keep them all on the boot CPU. A driver that takes
+// over the timer leaves the kernel without ticks to count on there.
+NORETURN void syscall_lapic(Process *p, u64 flags) {
+    p->pinned = cpu::cpus[0];
+    if (flags & LAPIC_TIMER) {
+        p->pinned->timer_claimed = true;
+    }
+    syscall_return(p, 0);
+}
+
+// Statistics for the index'th process, in registers:
+// rdi = user cycles
+// rsi = kernel cycles
+// rdx = priority | base priority << 8 | id of the CPU it last ran on << 16
+// r8, r9 = first 16 bytes of the name, NUL-padded
+NORETURN void syscall_procstat(Process *p, u64 index) {
+    Process *q = proc::all_processes;
+    while (q && index--) {
+        q = q->next_process;
+    }
+    if (!q) {
+        syscall_return(p, -1);
+    }
+    p->regs.rdi = q->user_cycles;
+    p->regs.rsi = q->kernel_cycles;
+    p->regs.rdx = q->priority | q->base_priority << 8
+        | (q->last_cpu ? q->last_cpu->id : 0) << 16;
+    char name[16] = {};
+    const size_t n = strlen(q->name());
+    memcpy(name, q->name(), n < sizeof(name) ? n : sizeof(name));
+    memcpy(&p->regs.r8, name, 8);
+    memcpy(&p->regs.r9, name + 8, 8);
+    p->set(proc::MsgRegs);
+    syscall_return(p, 0);
+}
+
+NORETURN void syscall_msgbuf(Process *p, uintptr_t vaddr) {
+    using namespace aspace;
+
+    log(msgbuf, "%s msgbuf: %lx\n", p->name(), vaddr);
+    if (!vaddr) {
+        p->set_msgbuf(0);
+        syscall_return(p, 0);
+    }
+    uintptr_t offsetFlags, handle;
+    if ((vaddr & 0xfff) || !p->aspace->find_mapping(vaddr, offsetFlags, handle)
+            || handle || (offsetFlags & MAP_DMA) != MAP_ANON
+            || (offsetFlags & MAP_RW) != MAP_RW) {
+        syscall_return(p, -1);
+    }
+    // Back it right away, so the kernel never has to fault it in.
+    Backing *back = p->aspace->find_add_backing(vaddr);
+    if (!mem::frame(back->paddr())) {
+        syscall_return(p, -1);
+    }
+    p->aspace->add_pte(back->vaddr(), back->pte());
+    p->set_msgbuf(back->paddr());
+    syscall_return(p, 0);
+}
+
+// The process a send through h would go to right away, if it's simple enough
+// for the fast path: the first process receiving on the peer handle, or
+// otherwise the first one in an open receive.
+Process *fast_recipient(Handle *h) {
+    if (h->other && h->other->receivers.head) {
+        Process *p = h->other->receivers.head;
+        return p->ipc_state() == proc::mask(proc::InRecv) ? p : nullptr;
+    }
+    return h->otherspace ? h->otherspace->peek_open_recipient() : nullptr;
+}
+
 } // namespace
 
+extern "C" void syscall_ipc_fast(u64, u64, u64, u64, u64, u64, u64);
+
+// Fast path for IPC, called by syscall_entry_stub before syscall(). Handles
+// a send or call to a process that's already waiting in a plain receive and
+// would run next on this CPU anyway, and returns straight to it with msgret.
+// Otherwise returns, without changing anything, to take the slow path.
+void syscall_ipc_fast(u64 arg0, u64 arg1, u64 arg2, u64 arg5, u64 arg3, u64 arg4, u64 nr) {
+    const u64 kind = nr & MSG_KIND_MASK;
+    if ((nr & ~(u64)(MSG_KIND_MASK | MSG_MASK))
+            || (kind != MSG_KIND_SEND && kind != MSG_KIND_CALL)) {
+        return;
+    }
+    cpu::kernel_lock.lock();
+    Cpu &c = getcpu();
+    Process *p = c.process;
+    Handle *h = p->find_handle(arg0);
+    Process *t = h ? fast_recipient(h) : nullptr;
+    if (!t || (t->pinned && t->pinned != &c)) {
+        cpu::kernel_lock.unlock();
+        return;
+    }
+    // The recipient must be what deliver_message and handoff pick to run.
+    const bool call = kind == MSG_KIND_CALL;
+    const u8 prio = call && p->priority < t->priority ? p->priority : t->priority;
+    if ((!call && p->priority < t->priority) || (prio && c.ready_at(prio - 1))) {
+        cpu::kernel_lock.unlock();
+        return;
+    }
+
+    log(ipc, "%s fast %s to %lx (%s)\n", p->name(), call ? "call" : "send",
+            arg0, t->name());
+    c.leave(p);
+    p->set(proc::FastRet);
+    p->set(proc::InSend);
+    if (call) {
+        p->set(proc::InRecv);
+    }
+    set_message(p, h, nr, arg1, arg2, arg3, arg4, arg5);
+    Process *q = h->other && h->other->receivers.head
+        ? p->aspace->pop_recipient(h) : h->otherspace->pop_open_recipient();
+    assert(q == t);
+    Process *next = deliver_message(t, p);
+    assert(next == t);
+    t->unset(proc::FastRet);
+    t->unset(proc::MsgRegs);
+    c.handoffs++;
+    c.fastpaths++;
+    c.enter(t);
+    cpu::msgret(t);
+}
+
 extern "C" void syscall(u64, u64, u64, u64, u64, u64, u64) NORETURN;
 
 #define SC_UNIMPL(name) case SYS_##name: unimpl(#name)
 
 NORETURN void syscall(u64 arg0, u64 arg1, u64 arg2, u64 arg5, u64 arg3, u64 arg4, u64 nr) {
+    cpu::kernel_lock.lock();
     auto p = getcpu().process;
     log(syscall, "%s: syscall %#x: %lx %lx %lx %lx %lx %lx\n",
             p->name(),
@@ -418,12 +917,29 @@ NORETURN void syscall(u64 arg0, u64 arg1, u64 arg2, u64 arg5, u64 arg3, u64 arg4
     case SYS_YIELD:
         syscall_yield(p);
         break;
+    case SYS_SETPRIO:
+        syscall_setprio(p, arg0);
+        break;
+    case SYS_PROCSTAT:
+        syscall_procstat(p, arg0);
+        break;
+    case SYS_MSGBUF:
+        syscall_msgbuf(p, arg0);
+        break;
+    case SYS_BATCH:
+        syscall_batch(p, arg0, arg1);
+        break;
+    case SYS_LAPIC:
+        syscall_lapic(p, arg0);
+        break;
     default:
         if (nr >= MSG_USER) {
             if ((nr & MSG_KIND_MASK) == MSG_KIND_SEND) {
                 ipc_send(p, nr, arg0, arg1, arg2, arg3, arg4, arg5);
             } else if ((nr & MSG_KIND_MASK) == MSG_KIND_CALL) {
                 ipc_call(p, nr, arg0, arg1, arg2, arg3, arg4, arg5);
+            } else if ((nr & MSG_KIND_MASK) == MSG_KIND_REPLYWAIT) {
+                ipc_replywait(p, nr, arg0, arg1, arg2, arg3, arg4, arg5);
             } else {
                 abort("unknown IPC kind");
             }
@@ -0,0 +1,106 @@
+; vim:filetype=nasm:
+
+; Startup code for application processors. This is copied to AP_TRAMPOLINE
+; (below 1MB, page aligned) by start_aps, and the APs start running it in real
+; mode after the startup IPI. Everything here must be position independent or
+; use T() to get the address it'll have after copying.
+;
+; All APs are started at the same time and share one boot stack, so they take
+; turns with the lock in the arguments. The lock is released by C++ code after
+; switching to the CPU's own stack.
+
+AP_TRAMPOLINE	equ	0x8000
+
+%define T(label) (AP_TRAMPOLINE + (label) - ap_trampoline)
+
+CR0_PE		equ	1
+MSR_EFER	equ	0xc0000080
+EFER_SCE	equ	1
+EFER_LME	equ	0x100
+EFER_NXE	equ	0x800
+
+; Must match trampoline::Args in main.cc
+struc args
+	.lock	resd 1
+	.cr0	resd 1
+	.cr3	resd 1
+	.cr4	resd 1
+	.stack	resq 1
+	.entry	resq 1
+endstruc
+
+section .rodata.ap_trampoline
+
+global ap_trampoline
+global ap_trampoline_args
+global ap_trampoline_end
+
+align 16
+bits 16
+ap_trampoline:
+	cli
+	cld
+	xor	ax, ax
+	mov	ds, ax
+
+.lock:
+	lock bts dword [T(ap_trampoline_args) + args.lock], 0
+	jnc	.locked
+	pause
+	jmp	.lock
+.locked:
+
+	lgdt	[T(gdtr)]
+	mov	eax, cr0
+	or	al, CR0_PE
+	mov	cr0, eax
+	jmp	dword 8:T(.pmode)
+
+bits 32
+.pmode:
+	mov	ax, 16
+	mov	ds, ax
+	mov	es, ax
+	mov	ss, ax
+
+	; Same paging and control register setup as the BSP.
+	mov	eax, [T(ap_trampoline_args) + args.cr4]
+	mov	cr4, eax
+	mov	eax, [T(ap_trampoline_args) + args.cr3]
+	mov	cr3, eax
+
+	mov	ecx, MSR_EFER
+	mov	eax, EFER_NXE | EFER_LME | EFER_SCE
+	xor	edx, edx
+	wrmsr
+
+	mov	eax, [T(ap_trampoline_args) + args.cr0]
+	mov	cr0, eax
+	jmp	24:T(.lmode)
+
+bits 64
+.lmode:
+	mov	rsp, [T(ap_trampoline_args) + args.stack]
+	mov	rax, [T(ap_trampoline_args) + args.entry]
+	call	rax
+	ud2
+
+; Just enough of the kernel GDT to get into long mode, with the same
+; selectors for 32-bit code/data and 64-bit code.
+align 8
+gdt:
+	dq	0
+	dq	0x00cf9a000000ffff
+	dq	0x00cf92000000ffff
+	dq	0x00209a0000000000
+gdt_end:
+
+gdtr:
+	dw	gdt_end - gdt - 1
+	dd	T(gdt)
+
+align 8
+ap_trampoline_args:
+	istruc args
+	iend
+ap_trampoline_end: